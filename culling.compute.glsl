@@ -0,0 +1,83 @@
+#version 450
+
+// Culls the instances of one mesh against the frustum and optionally a Hi-Z pyramid.
+// The indices of visible instances are compacted into uVisibleInstances, counted by the instance count of
+// the indirect command, which RenderingContext::resetIndirectCommand must reset before every dispatch.
+// Dispatch (instanceCount + 63) / 64 groups, then draw with RenderPass::addIndirectToDrawQueue, see image_culled.vert.glsl.
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+struct Instance {
+	mat4 modelMatrix;
+	vec4 boundsMin; // local space, w is unused
+	vec4 boundsMax;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { Instance uInstances[]; };
+layout(std430, binding = 1) writeonly buffer VisibleInstances { uint uVisibleInstances[]; };
+// DrawElementsIndirectCommand or DrawArraysIndirectCommand, both keep the instance count at index 1.
+layout(std430, binding = 2) buffer IndirectCommand { uint uCommand[]; };
+
+layout(std140, binding = 2) uniform MaterialInfo {
+	mat4 uViewProjection;
+	vec2 uHiZSize; // size of mip 0
+	uint uInstanceCount;
+	uint uHiZMipCount; // 0 disables occlusion culling
+};
+
+// Farthest depth of each texel, every mip holds the maximum of the 2x2 texels below it.
+uniform sampler2D uHiZ;
+
+bool occluded(vec3 ndcMin, vec3 ndcMax) {
+	vec2 uvMin = clamp(ndcMin.xy * 0.5 + 0.5, 0.0, 1.0);
+	vec2 uvMax = clamp(ndcMax.xy * 0.5 + 0.5, 0.0, 1.0);
+	// Pick the mip where the box covers at most 2x2 texels
+	vec2 size = (uvMax - uvMin) * uHiZSize;
+	float mip = clamp(ceil(log2(max(max(size.x, size.y), 1.0))), 0.0, float(uHiZMipCount - 1u));
+	float depth = max(
+		max(textureLod(uHiZ, uvMin, mip).r, textureLod(uHiZ, vec2(uvMax.x, uvMin.y), mip).r),
+		max(textureLod(uHiZ, vec2(uvMin.x, uvMax.y), mip).r, textureLod(uHiZ, uvMax, mip).r));
+	return ndcMin.z * 0.5 + 0.5 > depth;
+}
+
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= uInstanceCount)
+		return;
+
+	Instance instance = uInstances[index];
+	mat4 mvp = uViewProjection * instance.modelMatrix;
+
+	// A box is outside when all of its corners are outside the same clip plane.
+	uint outsideAll = 0x3Fu;
+	bool crossesNearPlane = false;
+	vec3 ndcMin = vec3(1.0);
+	vec3 ndcMax = vec3(-1.0);
+	for (int i = 0; i < 8; ++i) {
+		vec3 corner = mix(instance.boundsMin.xyz, instance.boundsMax.xyz, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+		vec4 clip = mvp * vec4(corner, 1.0);
+		uint outside = 0u;
+		outside |= clip.x < -clip.w ? 0x01u : 0u;
+		outside |= clip.x > clip.w ? 0x02u : 0u;
+		outside |= clip.y < -clip.w ? 0x04u : 0u;
+		outside |= clip.y > clip.w ? 0x08u : 0u;
+		outside |= clip.z < -clip.w ? 0x10u : 0u;
+		outside |= clip.z > clip.w ? 0x20u : 0u;
+		outsideAll &= outside;
+		if (clip.w <= 0.0) {
+			crossesNearPlane = true;
+		} else {
+			vec3 ndc = clip.xyz / clip.w;
+			ndcMin = min(ndcMin, ndc);
+			ndcMax = max(ndcMax, ndc);
+		}
+	}
+	if (outsideAll != 0u)
+		return;
+
+	// The screen space rectangle is meaningless if the box reaches behind the camera.
+	if (uHiZMipCount > 0u && !crossesNearPlane && occluded(ndcMin, ndcMax))
+		return;
+
+	uint slot = atomicAdd(uCommand[1], 1u);
+	uVisibleInstances[slot] = index;
+}
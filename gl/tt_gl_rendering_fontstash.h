@@ -44,12 +44,12 @@ namespace {
 		int h = rect[3] - rect[1];
 
         // TODO: Make renderer agnostic somehow
-		int width;
+		unsigned int width, height;
+        context.context->imageSize(context.image, width, height);
 		glBindTexture(GL_TEXTURE_2D, (GLuint)context.image.identifier()); TT_GL_DBG_ERR;
 		
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width); TT_GL_DBG_ERR;
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); TT_GL_DBG_ERR;
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, width); TT_GL_DBG_ERR;
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)width); TT_GL_DBG_ERR;
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect[0]); TT_GL_DBG_ERR;
 		glPixelStorei(GL_UNPACK_SKIP_ROWS, rect[1]); TT_GL_DBG_ERR;
         
@@ -60,6 +60,9 @@ namespace {
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0); TT_GL_DBG_ERR;
         glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0); TT_GL_DBG_ERR;
         glPixelStorei(GL_UNPACK_SKIP_ROWS, 0); TT_GL_DBG_ERR;
+
+        // We changed texture bindings behind the context's back.
+        static_cast<TTRendering::OpenGLContext*>(context.context)->invalidateStateCache();
 	}
 
     // TODO: not necessary or supported, should we omit it?
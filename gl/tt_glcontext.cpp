@@ -3,8 +3,10 @@
 #include "tt_gl.h"
 #include "../../tt_cpplib/tt_window.h"
 #include "../../tt_cpplib/tt_files.h"
+#include "../tt_profiler.h"
 
 #include <unordered_set>
+#include <deque>
 #include <string>
 
 namespace {
@@ -77,10 +79,15 @@ namespace {
 		return 0;
 	}
 
+	// Sampler and image types, from the same table as _mapType.
+	bool _isSamplerType(GLenum glType) {
+		return glType >= GL_SAMPLER_1D && glType <= GL_UNSIGNED_INT_IMAGE_2D_MULTISAMPLE_ARRAY;
+	}
+
 	TTRendering::UniformType _mapType(GLenum glType) {
 		using namespace TTRendering;
 		// Table from: https://registry.khronos.org/OpenGL-Refpages/gl4/html/glGetActiveUniform.xhtml
-		if (glType >= GL_SAMPLER_1D && glType <= GL_UNSIGNED_INT_IMAGE_2D_MULTISAMPLE_ARRAY)
+		if (_isSamplerType(glType))
 			return UniformType::Image;
 		switch (glType) {
 		case GL_FLOAT:
@@ -199,6 +206,24 @@ namespace {
 		return GL_UNSIGNED_INT;
 	}
 
+	// Byte offset of the first index of a draw, as glDrawElements* take it.
+	const void* indexOffset(GLenum indexType, size_t firstIndex) {
+		size_t indexSize = indexType == GL_UNSIGNED_BYTE ? 1 : (indexType == GL_UNSIGNED_SHORT ? 2 : 4);
+		return (const void*)(firstIndex * indexSize);
+	}
+
+	size_t triangleCount(GLenum primitiveType, size_t numElements, size_t instanceCount) {
+		size_t instances = instanceCount > 0 ? instanceCount : 1;
+		switch (primitiveType) {
+		case GL_TRIANGLES:
+			return numElements / 3 * instances;
+		case GL_TRIANGLE_FAN:
+		case GL_TRIANGLE_STRIP:
+			return numElements > 2 ? (numElements - 2) * instances : 0;
+		}
+		return 0;
+	}
+
 	void vertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer) {
 		if (type == GL_DOUBLE) {
 			glVertexAttribLPointer(index, size, type, stride, pointer);
@@ -230,11 +255,519 @@ namespace TTRendering {
 			return { name, _mapType(type), 0, (unsigned int)size };
 		}
 
+        // Only plain draws can become automatic instances, their push constants are all that differs.
+        bool instanceable(const DrawInfo& draw) {
+            return draw.instanceCount == 0 && draw.indirectBuffer == 0;
+        }
+
 		GLuint passUbo;
 		size_t passUboSize = 0;
-		GLuint materialUbo;
-		size_t materialUboSize = 0;
-		GLuint pushConstantsUbo;
+
+        // Every material keeps its uniform block in its own slice of one big UBO, so binding a material
+        // is a single glBindBufferRange and only bytes that changed since the last pass are uploaded.
+        // Freed slices are recycled by size, shaders tend to create many materials of the same size.
+        struct MaterialArena {
+            GLuint buffer = 0;
+            size_t capacity = 0;
+            size_t head = 0;
+            size_t alignment = 256;
+            std::unordered_map<size_t, std::vector<size_t>> freeSlices; // aligned slice size to offsets
+
+            void init() {
+                GLint offsetAlignment;
+                glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offsetAlignment);
+                alignment = (size_t)offsetAlignment;
+                capacity = 1 << 20;
+                glGenBuffers(1, &buffer);
+                glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+                glBufferData(GL_UNIFORM_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            }
+
+            size_t sliceSize(size_t size) const { return (size + alignment - 1) / alignment * alignment; }
+
+            // Existing slices keep their offsets, the old contents are copied over on the GPU.
+            // Returns the name of the buffer that got replaced, draws in flight may still read it so the caller retires it.
+            GLuint grow(size_t required) {
+                size_t newCapacity = std::max(capacity * 2, required);
+                GLuint newBuffer;
+                glGenBuffers(1, &newBuffer);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+                glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, nullptr, GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, head);
+                glBindBuffer(GL_COPY_READ_BUFFER, 0);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+                GLuint oldBuffer = buffer;
+                buffer = newBuffer;
+                capacity = newCapacity;
+                return oldBuffer;
+            }
+
+            // Returns the offset of the new slice. oldBuffer is set if the arena had to grow.
+            size_t allocate(size_t size, GLuint& oldBuffer) {
+                oldBuffer = 0;
+                size = sliceSize(size);
+                auto it = freeSlices.find(size);
+                if (it != freeSlices.end() && !it->second.empty()) {
+                    size_t offset = it->second.back();
+                    it->second.pop_back();
+                    return offset;
+                }
+                if (head + size > capacity)
+                    oldBuffer = grow(head + size);
+                size_t offset = head;
+                head += size;
+                return offset;
+            }
+
+            void free(size_t offset, size_t size) {
+                freeSlices[sliceSize(size)].push_back(offset);
+            }
+        } materialArena;
+
+        // Persistently mapped ring buffer for push constants.
+        // All push constants of a pass are staged contiguously and copied in with a single memcpy,
+        // then every draw binds its own aligned range. Every pass gets a fenced segment of the ring,
+        // and we wait on those fences before writing over a segment again.
+        struct PushConstantsRing {
+            struct Segment {
+                size_t begin;
+                size_t end;
+                GLsync fence;
+            };
+
+            GLuint buffer = 0;
+            unsigned char* mapped = nullptr;
+            size_t capacity = 0;
+            size_t stride = 0; // sizeof(PushConstants) rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+            size_t head = 0;
+            std::deque<Segment> inFlight;
+
+            std::vector<unsigned char> staging;
+            size_t stagedCount = 0;
+            size_t passBegin = 0; // start of the segment of the current pass
+            size_t cursor = 0; // next range to bind in the current pass
+
+            void init() {
+                GLint alignment;
+                glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+                stride = (sizeof(PushConstants) + alignment - 1) / alignment * alignment;
+                allocate(stride * 4096);
+            }
+
+            void allocate(size_t size) {
+                capacity = size;
+                head = 0;
+                glGenBuffers(1, &buffer);
+                glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_UNIFORM_BUFFER, capacity, nullptr, flags);
+                mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, capacity, flags);
+                glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            }
+
+            void waitForOldestSegment() {
+                const Segment& segment = inFlight.front();
+                while (true) {
+                    GLenum status = glClientWaitSync(segment.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+                    if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED || status == GL_WAIT_FAILED)
+                        break;
+                }
+                glDeleteSync(segment.fence);
+                inFlight.pop_front();
+            }
+
+            // Returns the name of the buffer that got replaced, the caller retires it.
+            GLuint grow(size_t required) {
+                // Everything in flight still references the old buffer.
+                while (!inFlight.empty())
+                    waitForOldestSegment();
+                glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+                glUnmapBuffer(GL_UNIFORM_BUFFER);
+                glBindBuffer(GL_UNIFORM_BUFFER, 0);
+                GLuint oldBuffer = buffer;
+                allocate(std::max(capacity * 2, required));
+                return oldBuffer;
+            }
+
+            void beginPass() {
+                staging.clear();
+                stagedCount = 0;
+            }
+
+            void stage(const PushConstants* pushConstants) {
+                if (!pushConstants) return;
+                staging.resize((stagedCount + 1) * stride);
+                memcpy(staging.data() + stagedCount * stride, pushConstants, sizeof(PushConstants));
+                ++stagedCount;
+            }
+
+            // Returns the name of the buffer that got replaced if we had to grow, or 0.
+            GLuint upload() {
+                size_t size = staging.size();
+                cursor = passBegin = head;
+                if (size == 0) return 0;
+                GLuint oldBuffer = 0;
+                if (size > capacity)
+                    oldBuffer = grow(size);
+                if (head + size > capacity)
+                    head = 0;
+                // After a wrap the front may be an old tail segment that does not overlap while a newer one does,
+                // so look at all of them. Fences signal in order, so we wait up to the newest overlapping segment.
+                size_t overlapping = 0;
+                for (size_t i = 0; i < inFlight.size(); ++i) {
+                    if (inFlight[i].begin < head + size && head < inFlight[i].end)
+                        overlapping = i + 1;
+                }
+                for (; overlapping > 0; --overlapping)
+                    waitForOldestSegment();
+                memcpy(mapped + head, staging.data(), size);
+                cursor = passBegin = head;
+                head += size;
+                return oldBuffer;
+            }
+
+            size_t next() {
+                size_t offset = cursor;
+                cursor += stride;
+                return offset;
+            }
+
+            void endPass() {
+                if (head == passBegin) return;
+                GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                inFlight.push_back({ passBegin, head, fence });
+            }
+        } pushConstantsRing;
+
+        // Staging for RenderPass::setMultiDrawIndirect.
+        // Indirect commands and the push constants they index with gl_DrawID are gathered per pass
+        // and uploaded with one call each. Submission walks the batches again in the same order.
+        struct MultiDrawIndirect {
+            GLuint indirectBuffer = 0;
+            GLuint pushConstantsBuffer = 0;
+            size_t pushConstantsAlignment = 1; // GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT in elements
+            // DrawElementsIndirectCommand (5 uints) or DrawArraysIndirectCommand (4 uints), tightly packed.
+            std::vector<GLuint> commands;
+            std::vector<PushConstants> pushConstants;
+            size_t commandCursor = 0;
+            size_t pushConstantsCursor = 0;
+
+            void init() {
+                glGenBuffers(1, &indirectBuffer);
+                glGenBuffers(1, &pushConstantsBuffer);
+                GLint alignment;
+                glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+                pushConstantsAlignment = std::max((size_t)1, (size_t)alignment / sizeof(PushConstants));
+            }
+
+            void beginPass() {
+                commands.clear();
+                pushConstants.clear();
+                commandCursor = 0;
+                pushConstantsCursor = 0;
+            }
+
+            static size_t alignUp(size_t value, size_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+            void beginBatch() {
+                // Every batch binds its own range of push constants, so gl_DrawID 0 is the first draw in the batch.
+                pushConstants.resize(alignUp(pushConstants.size(), pushConstantsAlignment));
+            }
+
+            void add(const PassDraw& draw) {
+                GLuint instanceCount = draw.instanceCount > 0 ? (GLuint)draw.instanceCount : 1;
+                if (draw.indirectBuffer) {
+                    // The command is in the draw's own buffer, see drawIndirect.
+                } else if (draw.indexType) {
+                    // count, instanceCount, firstIndex, baseVertex, baseInstance
+                    commands.insert(commands.end(), { (GLuint)draw.numElements, instanceCount, (GLuint)draw.firstIndex, (GLuint)draw.baseVertex, 0 });
+                } else {
+                    // count, instanceCount, first, baseInstance
+                    commands.insert(commands.end(), { (GLuint)draw.numElements, instanceCount, (GLuint)draw.baseVertex, 0 });
+                }
+                pushConstants.push_back(draw.pushConstants ? *draw.pushConstants : PushConstants{});
+            }
+
+            void upload() {
+                if (pushConstants.empty()) return;
+                // Passes of only indirect draws have push constants but no commands.
+                if (!commands.empty()) {
+                    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+                    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(GLuint), commands.data(), GL_STREAM_DRAW);
+                    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+                }
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, pushConstantsBuffer);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, pushConstants.size() * sizeof(PushConstants), pushConstants.data(), GL_STREAM_DRAW);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            }
+
+            size_t nextPushConstantsOffset() {
+                pushConstantsCursor = alignUp(pushConstantsCursor, pushConstantsAlignment);
+                return pushConstantsCursor * sizeof(PushConstants);
+            }
+
+            // Expects the range from nextPushConstantsOffset to be bound.
+            void draw(const PassDraw& first, size_t count) {
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+                if (first.indexType) {
+                    glMultiDrawElementsIndirect(first.primitiveType, first.indexType, (const void*)(commandCursor * sizeof(GLuint)), (GLsizei)count, 0);
+                    commandCursor += count * 5;
+                } else {
+                    glMultiDrawArraysIndirect(first.primitiveType, (const void*)(commandCursor * sizeof(GLuint)), (GLsizei)count, 0);
+                    commandCursor += count * 4;
+                }
+                TT_GL_DBG_ERR;
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+                pushConstantsCursor += count;
+            }
+
+            // Batch of a single indirect draw, its command is at commandOffset in its own buffer.
+            void drawIndirect(const PassDraw& draw, size_t commandOffset) {
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, (GLuint)draw.indirectBuffer);
+                if (draw.indexType) {
+                    glMultiDrawElementsIndirect(draw.primitiveType, draw.indexType, (const void*)commandOffset, 1, 0);
+                } else {
+                    glMultiDrawArraysIndirect(draw.primitiveType, (const void*)commandOffset, 1, 0);
+                }
+                TT_GL_DBG_ERR;
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+                pushConstantsCursor += 1;
+            }
+        } multiDrawIndirect;
+
+        // Staging for RenderPass::setAutoInstancing.
+        // The push constants of all automatically instanced draws of a pass go into one storage buffer,
+        // every draw finds its own at gl_BaseInstance.
+        struct AutoInstancing {
+            GLuint buffer = 0;
+            std::vector<PushConstants> pushConstants;
+            size_t cursor = 0;
+
+            void init() {
+                glGenBuffers(1, &buffer);
+            }
+
+            void beginPass() {
+                pushConstants.clear();
+                cursor = 0;
+            }
+
+            void add(const PassDraw& draw) {
+                pushConstants.push_back(draw.pushConstants ? *draw.pushConstants : PushConstants{});
+            }
+
+            // Returns whether there is anything to bind.
+            bool upload() {
+                if (pushConstants.empty()) return false;
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, pushConstants.size() * sizeof(PushConstants), pushConstants.data(), GL_STREAM_DRAW);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+                return true;
+            }
+
+            void draw(const PassDraw& draw, size_t count) {
+                if (draw.indexType) {
+                    glDrawElementsInstancedBaseVertexBaseInstance(draw.primitiveType, (GLsizei)draw.numElements, draw.indexType, indexOffset(draw.indexType, draw.firstIndex), (GLsizei)count, (GLint)draw.baseVertex, (GLuint)cursor);
+                } else {
+                    glDrawArraysInstancedBaseInstance(draw.primitiveType, (GLint)draw.baseVertex, (GLsizei)draw.numElements, (GLsizei)count, (GLuint)cursor);
+                }
+                cursor += count;
+            }
+        } autoInstancing;
+
+        // GL_TIME_ELAPSED queries of timed passes and dispatches. Finished queries go back to the pool once their
+        // result has been read, which only happens after GL_QUERY_RESULT_AVAILABLE says it will not stall.
+        struct GpuTimerQueries {
+            struct Pending {
+                GLuint query;
+                std::string name;
+            };
+            std::vector<GLuint> pool;
+            std::deque<Pending> pending;
+
+            void begin(const std::string& name) {
+                GLuint query;
+                if (pool.empty()) {
+                    glGenQueries(1, &query);
+                } else {
+                    query = pool.back();
+                    pool.pop_back();
+                }
+                glBeginQuery(GL_TIME_ELAPSED, query);
+                pending.push_back({ query, name });
+            }
+
+            void end() {
+                glEndQuery(GL_TIME_ELAPSED);
+            }
+
+            // Calls record(name, milliseconds) for every query that finished, in submission order.
+            template<typename F>
+            void collect(F&& record) {
+                while (!pending.empty()) {
+                    const Pending& front = pending.front();
+                    GLint available = 0;
+                    glGetQueryObjectiv(front.query, GL_QUERY_RESULT_AVAILABLE, &available);
+                    // The GPU finishes queries in order, so nothing after this one is ready either.
+                    if (!available)
+                        break;
+                    GLuint64 nanoseconds = 0;
+                    glGetQueryObjectui64v(front.query, GL_QUERY_RESULT, &nanoseconds);
+                    record(front.name, (double)nanoseconds / 1000000.0);
+                    pool.push_back(front.query);
+                    pending.pop_front();
+                }
+            }
+        } gpuTimerQueries;
+
+        // GL objects deleted during a frame are only handed to the driver once the GPU is done with that frame,
+        // so tearing down a resource pool does not stall on objects that are still in use.
+        struct RetireQueue {
+            struct Batch {
+                std::vector<GLuint> buffers;
+                std::vector<GLuint> vertexArrays;
+                std::vector<GLuint> textures;
+                std::vector<GLuint> framebuffers;
+                std::vector<GLuint> shaders;
+                std::vector<GLuint> programs;
+
+                bool empty() const {
+                    return buffers.empty() && vertexArrays.empty() && textures.empty() && framebuffers.empty() && shaders.empty() && programs.empty();
+                }
+            };
+            struct Retired {
+                Batch batch;
+                GLsync fence;
+            };
+
+            Batch current; // deleted since the last endFrame
+            std::deque<Retired> retired;
+
+            void endFrame() {
+                if (current.empty()) return;
+                GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                retired.push_back({ std::move(current), fence });
+                current = {};
+            }
+
+            // Pops the oldest batch if its frame finished on the GPU, or regardless when forced.
+            bool popFinished(Batch& batch, bool force) {
+                if (retired.empty()) return false;
+                Retired& oldest = retired.front();
+                if (!force) {
+                    GLenum status = glClientWaitSync(oldest.fence, 0, 0);
+                    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                        return false;
+                }
+                glDeleteSync(oldest.fence);
+                batch = std::move(oldest.batch);
+                retired.pop_front();
+                return true;
+            }
+        } retireQueue;
+
+        // BufferMode::Stream buffers stay mapped for their whole life and hold one region per frame in flight.
+        // The CPU writes the region of the current frame while the GPU still reads the older ones,
+        // a fence per region tells when it may be written again.
+        struct StreamBuffers {
+            static const size_t regionCount = 3;
+
+            struct Buffer {
+                unsigned char* mapped;
+                size_t regionSize;
+            };
+            // A vertex attribute sourced from a stream buffer, re-pointed at the active region every frame.
+            struct Attribute {
+                GLuint buffer;
+                GLuint location;
+                size_t offset;
+                GLsizei stride;
+            };
+
+            std::unordered_map<GLuint, Buffer> buffers;
+            std::unordered_map<GLuint, std::vector<Attribute>> vertexArrays;
+            GLsync fences[regionCount] = {};
+            size_t region = 0;
+
+            // Byte offset of the active region, 0 for any other buffer.
+            size_t offset(GLuint buffer) const {
+                if (buffers.empty()) return 0;
+                auto it = buffers.find(buffer);
+                return it == buffers.end() ? 0 : region * it->second.regionSize;
+            }
+
+            unsigned char* map(GLuint buffer) {
+                auto it = buffers.find(buffer);
+                TT::assert(it != buffers.end(), "Only BufferMode::Stream buffers can be mapped.");
+                if (it == buffers.end()) return nullptr;
+                // Only blocks when the CPU is more than regionCount - 1 frames ahead.
+                if (fences[region]) {
+                    GLenum status = GL_TIMEOUT_EXPIRED;
+                    while (status == GL_TIMEOUT_EXPIRED) {
+                        status = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+                    }
+                    glDeleteSync(fences[region]);
+                    fences[region] = 0;
+                }
+                return it->second.mapped + region * it->second.regionSize;
+            }
+
+            // Returns whether the region changed, i.e. the vertex arrays must be re-pointed.
+            bool endFrame() {
+                if (buffers.empty()) return false;
+                if (fences[region]) {
+                    glDeleteSync(fences[region]);
+                }
+                fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                region = (region + 1) % regionCount;
+                return true;
+            }
+        } streamBuffers;
+
+        // Walks the draws of a pass one (mesh layout, shader, material) bucket at a time, in draw order.
+        // The visitor gets the shader, the material, whether the shader changed since the previous bucket and the draws.
+        template<typename F>
+        void forEachBucket(const RenderPass& pass, F&& visit) {
+            std::vector<const DrawInfo*> draws;
+            bool shaderChanged = true;
+            if (pass.drawQueueMode() == DrawQueueMode::Sorted) {
+                // The list is sorted, so a bucket is a run of keys that only differ in their depth bits.
+                const DrawList& drawList = pass.drawList();
+                unsigned long long previousShaderKey = (unsigned long long)-1;
+                size_t i = 0;
+                while (i < drawList.keys.size()) {
+                    unsigned long long key = drawList.keys[i];
+                    unsigned long long bucketKey = key >> DrawList::depthBits;
+                    unsigned long long shaderKey = key >> (DrawList::materialBits + DrawList::depthBits);
+                    draws.clear();
+                    for (; i < drawList.keys.size() && (drawList.keys[i] >> DrawList::depthBits) == bucketKey; ++i)
+                        draws.push_back(&drawList.payloads[drawList.payloadIndices[i]]);
+                    visit(drawList.shaders[DrawList::shaderIndex(key)], drawList.materials[DrawList::materialIndex(key)], shaderKey != previousShaderKey, draws);
+                    previousShaderKey = shaderKey;
+                }
+                return;
+            }
+
+            const DrawQueue& drawQueue = pass.drawQueue();
+            for (const auto& shaderQueue : drawQueue.queues) {
+                for (size_t shaderIndex = 0; shaderIndex < shaderQueue.keys.size(); ++shaderIndex) {
+                    shaderChanged = true;
+                    const auto& materialQueue = shaderQueue.queues[shaderIndex];
+                    for (size_t materialIndex = 0; materialIndex < materialQueue.keys.size(); ++materialIndex) {
+                        draws.clear();
+                        for (const DrawInfo& draw : materialQueue.queues[materialIndex]) {
+                            if (draw.meshIdentifier != 0)
+                                draws.push_back(&draw);
+                        }
+                        if (draws.empty()) continue;
+                        visit(shaderQueue.keys[shaderIndex], materialQueue.keys[materialIndex], shaderChanged, draws);
+                        shaderChanged = false;
+                    }
+                }
+            }
+        }
 	}
 
 	std::unordered_map<int, UniformInfo> OpenGLContext::getUniformBlocks(const ShaderHandle& shader, const std::vector<ShaderStageHandle>& stages) const {
@@ -289,16 +822,51 @@ namespace TTRendering {
 		return result;
 	}
 
+	SamplerInfo OpenGLContext::getSamplers(const ShaderHandle& shader) const {
+		static std::hash<std::string> stringHasher;
+		SamplerInfo result;
+
+		GLuint program = (GLuint)shader.identifier();
+		GLint numUniforms = 0;
+		glGetProgramInterfaceiv(program, GL_UNIFORM, GL_ACTIVE_RESOURCES, &numUniforms);
+		static const GLenum properties[4] = { GL_TYPE, GL_ARRAY_SIZE, GL_LOCATION, GL_BLOCK_INDEX };
+		GLint data[4];
+		for (GLint uniformIx = 0; uniformIx < numUniforms; ++uniformIx) {
+			glGetProgramResourceiv(program, GL_UNIFORM, uniformIx, 4, properties, 4, nullptr, data);
+			// Samplers never live in a uniform block. Other default block uniforms may have types _mapType does not know.
+			if (data[3] != -1 || data[2] == -1 || !_isSamplerType((GLenum)data[0]))
+				continue;
+
+			char name[256];
+			memset(name, 0, sizeof(name));
+			glGetProgramResourceName(program, GL_UNIFORM, uniformIx, sizeof(name) - 1, nullptr, name);
+			// Arrays are reported as "name[0]"
+			std::string baseName = name;
+			size_t bracket = baseName.find('[');
+			if (bracket != std::string::npos)
+				baseName.resize(bracket);
+
+			GLint arraySize = data[1];
+			std::vector<GLint> units(arraySize);
+			for (GLint i = 0; i < arraySize; ++i) {
+				units[i] = (GLint)result.textureUnitCount++;
+				result.nameHashToTextureUnit[stringHasher(baseName + "[" + std::to_string(i) + "]")] = units[i];
+			}
+			result.nameHashToTextureUnit[stringHasher(baseName)] = units[0];
+			glProgramUniform1iv(program, data[2], arraySize, units.data());
+		}
+
+		return result;
+	}
+
     OpenGLContext::OpenGLContext() {
         TTRendering::loadGLFunctions();
         glEnable(GL_DEPTH_TEST); TT_GL_DBG_ERR;
         glGenBuffers(1, &passUbo);
-        glGenBuffers(1, &materialUbo);
-        glGenBuffers(1, &pushConstantsUbo);
-        glBindBuffer(GL_UNIFORM_BUFFER, pushConstantsUbo);
-        // glBufferData(GL_UNIFORM_BUFFER, sizeof(PushConstants), nullptr, GL_DYNAMIC_DRAW);
-        glBindBufferRange(GL_UNIFORM_BUFFER, (GLuint)UniformBlockSemantics::PushConstants, pushConstantsUbo, 0, sizeof(PushConstants));
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        materialArena.init();
+        pushConstantsRing.init();
+        multiDrawIndirect.init();
+        autoInstancing.init();
     }
 
     OpenGLContext::OpenGLContext(const TT::Window& window) {
@@ -307,11 +875,74 @@ namespace TTRendering {
     }
 
 	void OpenGLContext::beginFrame() {
+        TT_RENDERING_STAT(resetFrameStats());
+        collectGpuTimings();
+        drainRetireQueue(false);
 	}
 
+    void OpenGLContext::collectGpuTimings() {
+        gpuTimerQueries.collect([this](const std::string& name, double ms) { timings[name].addSample(ms); });
+    }
+
+    void OpenGLContext::drainRetireQueue(bool force) {
+        auto deleteBatch = [this](RetireQueue::Batch& batch) {
+            // Deleting reverts bindings to 0 and frees the names for reuse, so the state cache must forget them now.
+            if (!batch.buffers.empty()) {
+                glDeleteBuffers((GLsizei)batch.buffers.size(), batch.buffers.data());
+                for (GLuint buffer : batch.buffers)
+                    _stateCache.forgetBuffer(buffer);
+            }
+            if (!batch.vertexArrays.empty()) {
+                glDeleteVertexArrays((GLsizei)batch.vertexArrays.size(), batch.vertexArrays.data());
+                for (GLuint vertexArray : batch.vertexArrays) {
+                    if (_stateCache.vertexArray == vertexArray) _stateCache.vertexArray = StateCache::unknown;
+                }
+            }
+            if (!batch.textures.empty()) {
+                glDeleteTextures((GLsizei)batch.textures.size(), batch.textures.data());
+                for (GLuint texture : batch.textures)
+                    _stateCache.forgetTexture(texture);
+            }
+            if (!batch.framebuffers.empty()) {
+                glDeleteFramebuffers((GLsizei)batch.framebuffers.size(), batch.framebuffers.data());
+                for (GLuint framebuffer : batch.framebuffers) {
+                    if (_stateCache.framebuffer == framebuffer) _stateCache.framebuffer = StateCache::unknown;
+                }
+            }
+            // Shaders and programs have no batched delete.
+            for (GLuint shader : batch.shaders) {
+                glDeleteShader(shader);
+            }
+            for (GLuint program : batch.programs) {
+                glDeleteProgram(program);
+                if (_stateCache.program == program) _stateCache.program = StateCache::unknown;
+            }
+        };
+        RetireQueue::Batch batch;
+        while (retireQueue.popFinished(batch, force))
+            deleteBatch(batch);
+        // Without frames there is no fence to wait for, so whatever was deleted since goes right away.
+        if (force) {
+            deleteBatch(retireQueue.current);
+            retireQueue.current = {};
+        }
+    }
+
 	void OpenGLContext::endFrame() {
         if(_windowsGLContext)
 		    SwapBuffers(_windowsGLContext);
+        retireQueue.endFrame();
+        // Vertex arrays that read stream buffers follow them to the next region.
+        if (streamBuffers.endFrame()) {
+            for (const auto& pair : streamBuffers.vertexArrays) {
+                bindVertexArray(pair.first);
+                for (const StreamBuffers::Attribute& attribute : pair.second) {
+                    glBindVertexBuffer(attribute.location, attribute.buffer, streamBuffers.offset(attribute.buffer) + attribute.offset, attribute.stride);
+                }
+            }
+            bindVertexArray(0);
+        }
+        TT_RENDERING_STAT(finishFrameStats());
 	}
     
     BufferHandle OpenGLContext::createBuffer(size_t size, unsigned char* data, BufferMode mode, const ResourcePoolHandle* pool) {
@@ -320,11 +951,53 @@ namespace TTRendering {
         GLuint glHandle;
         glGenBuffers(1, &glHandle);
         glBindBuffer(GL_ARRAY_BUFFER, glHandle);
-        glBufferData(GL_ARRAY_BUFFER, size, data, mode == BufferMode::StaticDraw ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
+        if (mode == BufferMode::Stream) {
+            // Regions are aligned so they can also be bound as SSBO ranges.
+            GLint alignment = 256;
+            glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            size_t regionSize = (size + alignment - 1) / alignment * alignment;
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, regionSize * StreamBuffers::regionCount, nullptr, flags);
+            unsigned char* mapped = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, regionSize * StreamBuffers::regionCount, flags);
+            TT::assertFatal(mapped != nullptr);
+            if (data) {
+                for (size_t i = 0; i < StreamBuffers::regionCount; ++i)
+                    memcpy(mapped + i * regionSize, data, size);
+            }
+            streamBuffers.buffers[glHandle] = { mapped, regionSize };
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, size, data, mode == BufferMode::StaticDraw ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
+        }
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         return registerHandleToPool(BufferHandle(glHandle, size), pool);
     }
 
+    void OpenGLContext::writeBuffer(const BufferHandle& buffer, const void* data, size_t size, size_t offset) {
+        TT::assert(offset + size <= buffer.size());
+        if (streamBuffers.buffers.count((GLuint)buffer.identifier())) {
+            memcpy((unsigned char*)mapForWrite(buffer) + offset, data, size);
+            return;
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, (GLuint)buffer.identifier());
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    void* OpenGLContext::mapForWrite(const BufferHandle& buffer) {
+        return streamBuffers.map((GLuint)buffer.identifier());
+    }
+
+    void OpenGLContext::copyBuffer(const BufferHandle& source, size_t sourceOffset, const BufferHandle& destination, size_t destinationOffset, size_t size) {
+        TT::assert(sourceOffset + size <= source.size() && destinationOffset + size <= destination.size());
+        sourceOffset += streamBuffers.offset((GLuint)source.identifier());
+        destinationOffset += streamBuffers.offset((GLuint)destination.identifier());
+        glBindBuffer(GL_COPY_READ_BUFFER, (GLuint)source.identifier());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, (GLuint)destination.identifier());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sourceOffset, destinationOffset, size);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
 
     MeshHandle OpenGLContext::createMesh(
         size_t numElements, // num vertices if indexData == nullptr, else num indices
@@ -339,7 +1012,7 @@ namespace TTRendering {
 		GLuint glHandle;
 		glGenVertexArrays(1, &glHandle);
 
-		glBindVertexArray(glHandle);
+		bindVertexArray(glHandle);
 
 		// indices
 		if (indexData) {
@@ -356,7 +1029,10 @@ namespace TTRendering {
 		    size_t offset = 0;
 		    for (const auto& attribute : attributeLayout) {
 			    glEnableVertexAttribArray(attribute.location);
-			    vertexAttribPointer(attribute.location, ((int)attribute.dimensions + 1), glElementType(attribute.elementType), false, stride, (const void*)offset);
+			    // Stream buffers start out at the active region, endFrame moves them along from there
+			    vertexAttribPointer(attribute.location, ((int)attribute.dimensions + 1), glElementType(attribute.elementType), false, stride, (const void*)(streamBuffers.offset((GLuint)vertexData.identifier()) + offset));
+			    if (streamBuffers.buffers.count((GLuint)vertexData.identifier()))
+				    streamBuffers.vertexArrays[glHandle].push_back({ (GLuint)vertexData.identifier(), attribute.location, offset, (GLsizei)stride });
 			    offset += attribute.sizeInBytes();
 		    }
         }
@@ -371,15 +1047,17 @@ namespace TTRendering {
             size_t offset = 0;
 		    for (const MeshAttribute& attribute : instanceAttributeLayout) {
 				glEnableVertexAttribArray(attribute.location);
-				vertexAttribPointer(attribute.location, ((int)attribute.dimensions + 1), glElementType(attribute.elementType), false, stride, (const void*)offset);
+				vertexAttribPointer(attribute.location, ((int)attribute.dimensions + 1), glElementType(attribute.elementType), false, stride, (const void*)(streamBuffers.offset((GLuint)instanceData->identifier()) + offset));
 				glVertexAttribDivisor(attribute.location, 1);
+				if (streamBuffers.buffers.count((GLuint)instanceData->identifier()))
+					streamBuffers.vertexArrays[glHandle].push_back({ (GLuint)instanceData->identifier(), attribute.location, offset, (GLsizei)stride });
 				offset += attribute.sizeInBytes();
 		    }
 
         }
 
         glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
+		bindVertexArray(0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
         size_t attributeLayoutHash = TT::hashCombine(hashMeshLayout(attributeLayout), hashMeshLayout(instanceAttributeLayout));
@@ -387,6 +1065,7 @@ namespace TTRendering {
 	}
 
 	ShaderStageHandle OpenGLContext::createShaderStage(const char* glslFilePath) {
+		TT_PROFILE_SCOPE("createShaderStage");
 		std::unordered_set<std::string> dependencies;
 		std::string shaderCode = TT::readWithIncludes(glslFilePath);
 		std::vector<std::string> parts = TT::split(glslFilePath, ".");
@@ -434,34 +1113,64 @@ namespace TTRendering {
 	ImageHandle OpenGLContext::createImage(unsigned int width, unsigned int height, ImageFormat format, ImageInterpolation interpolation, ImageTiling tiling, const unsigned char* data, const ResourcePoolHandle* pool) {
 		GLuint glHandle;
 		glGenTextures(1, &glHandle); TT_GL_DBG_ERR;
-		glBindTexture(GL_TEXTURE_2D, glHandle); TT_GL_DBG_ERR;
+		bindTexture(0, glHandle); TT_GL_DBG_ERR;
 		GLenum repeatMode = (tiling == ImageTiling::Clamp) ? GL_CLAMP_TO_EDGE : GL_REPEAT;
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, repeatMode); TT_GL_DBG_ERR;
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, repeatMode); TT_GL_DBG_ERR;
-		GLenum interpMode = (interpolation == ImageInterpolation::Linear) ? GL_LINEAR : GL_NEAREST;
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, interpMode); TT_GL_DBG_ERR;
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, interpMode); TT_GL_DBG_ERR;
+		bool mipmapped = hasMipChain(interpolation);
+		GLenum magMode = (interpolation == ImageInterpolation::Nearest) ? GL_NEAREST : GL_LINEAR;
+		GLenum minMode = mipmapped ? GL_LINEAR_MIPMAP_LINEAR : magMode;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minMode); TT_GL_DBG_ERR;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magMode); TT_GL_DBG_ERR;
+		if (interpolation == ImageInterpolation::Anisotropic) {
+			GLfloat maxAnisotropy = 1.0f;
+			glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &maxAnisotropy); TT_GL_DBG_ERR;
+			glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY, maxAnisotropy); TT_GL_DBG_ERR;
+		}
 		GLenum internalFormat, channels, elementType;
 		glFormatInfo(format, internalFormat, channels, elementType); TT_GL_DBG_ERR;
-		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, channels, elementType, data); TT_GL_DBG_ERR;
-		glBindTexture(GL_TEXTURE_2D, 0); TT_GL_DBG_ERR;
+		unsigned int mipLevels = mipmapped ? mipLevelCount(width, height) : 1;
+		if (mipmapped) {
+			// Immutable storage for the whole chain, the driver does not have to validate levels on use.
+			glTexStorage2D(GL_TEXTURE_2D, mipLevels, internalFormat, width, height); TT_GL_DBG_ERR;
+			if (data) {
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1); TT_GL_DBG_ERR;
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, channels, elementType, data); TT_GL_DBG_ERR;
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4); TT_GL_DBG_ERR;
+				glGenerateMipmap(GL_TEXTURE_2D); TT_GL_DBG_ERR;
+			}
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, channels, elementType, data); TT_GL_DBG_ERR;
+		}
+		bindTexture(0, 0); TT_GL_DBG_ERR;
+		imageExtents[glHandle] = { width, height, mipLevels };
 		return registerHandleToPool(ImageHandle(glHandle, format, interpolation, tiling), pool);
 	}
 
-    void OpenGLContext::imageSize(const ImageHandle& image, unsigned int& width, unsigned int& height) const {
-        glBindTexture(GL_TEXTURE_2D, (GLuint)image.identifier()); TT_GL_DBG_ERR;
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, (int*)&width); TT_GL_DBG_ERR;
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, (int*)&height); TT_GL_DBG_ERR;
-        glBindTexture(GL_TEXTURE_2D, 0); TT_GL_DBG_ERR;
+    void OpenGLContext::writeImageLevel(const ImageHandle& image, unsigned int level, const unsigned char* data) {
+        const ImageExtent& extent = imageExtent(image);
+        TT::assert(level < extent.mipLevels);
+        GLenum internalFormat, channels, elementType;
+        glFormatInfo(image.format(), internalFormat, channels, elementType); TT_GL_DBG_ERR;
+        bindTexture(0, (GLuint)image.identifier()); TT_GL_DBG_ERR;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1); TT_GL_DBG_ERR;
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, std::max(1u, extent.width >> level), std::max(1u, extent.height >> level), channels, elementType, data); TT_GL_DBG_ERR;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4); TT_GL_DBG_ERR;
+        bindTexture(0, 0); TT_GL_DBG_ERR;
     }
 
     void OpenGLContext::resizeImage(const ImageHandle& image, unsigned int width, unsigned int height) {
+        if (imageExtent(image).mipLevels > 1) {
+            TT::assert(false, "Images with a mip chain have immutable storage and cannot be resized.");
+            return;
+        }
         GLuint glHandle = (GLuint)image.identifier();
-        glBindTexture(GL_TEXTURE_2D, glHandle); TT_GL_DBG_ERR;
+        bindTexture(0, glHandle); TT_GL_DBG_ERR;
         GLenum internalFormat, channels, elementType;
         glFormatInfo(image.format(), internalFormat, channels, elementType); TT_GL_DBG_ERR;
         glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, channels, elementType, nullptr); TT_GL_DBG_ERR;
-        glBindTexture(GL_TEXTURE_2D, 0); TT_GL_DBG_ERR;
+        bindTexture(0, 0); TT_GL_DBG_ERR;
+        imageExtents[glHandle] = { width, height };
     }
 
     void OpenGLContext::resizeFramebuffer(const FramebufferHandle& framebuffer, unsigned int width, unsigned int height) {
@@ -506,7 +1215,7 @@ namespace TTRendering {
 
 		GLuint glHandle;
 		glGenFramebuffers(1, &glHandle);
-		glBindFramebuffer(GL_FRAMEBUFFER, glHandle);
+		bindFramebuffer(glHandle);
 
 		unsigned int i = 0;
 		for (const auto& colorAttachment : colorAttachments) {
@@ -516,29 +1225,136 @@ namespace TTRendering {
 			glFramebufferTexture2D(GL_FRAMEBUFFER, depthStencilMode, GL_TEXTURE_2D, (GLuint)depthStencilAttachment->identifier(), 0);
 		}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		bindFramebuffer(0);
         return registerHandleToPool(FramebufferHandle(glHandle, colorAttachments, depthStencilAttachment));
 	}
 
-    void OpenGLContext::bindAndAllocateMaterialUBO(const UniformInfo* uniformInfo) const {
-        if (uniformInfo) {
-            glBindBuffer(GL_UNIFORM_BUFFER, materialUbo);
-            size_t requiredBufferSize = uniformInfo->bufferSize;
-            if (materialUboSize < requiredBufferSize) {
-                glBufferData(GL_UNIFORM_BUFFER, requiredBufferSize, nullptr, GL_DYNAMIC_DRAW);
-                materialUboSize = requiredBufferSize;
-            }
+    void OpenGLContext::StateCache::invalidate() {
+        program = unknown;
+        vertexArray = unknown;
+        framebuffer = unknown;
+        activeTexture = unknown;
+        for (unsigned int& texture : textures) texture = unknown;
+        blend = unknown;
+        depthMask = unknown;
+        blendSrc = unknown;
+        blendDst = unknown;
+        for (BufferRange& range : uniformBuffers) range = { unknown, 0, 0 };
+        for (BufferRange& range : storageBuffers) range = { unknown, 0, 0 };
+    }
+
+    void OpenGLContext::StateCache::forgetBuffer(unsigned int buffer) {
+        for (BufferRange& range : uniformBuffers) if (range.buffer == buffer) range.buffer = unknown;
+        for (BufferRange& range : storageBuffers) if (range.buffer == buffer) range.buffer = unknown;
+    }
+
+    void OpenGLContext::StateCache::forgetTexture(unsigned int texture) {
+        for (unsigned int& bound : textures) if (bound == texture) bound = unknown;
+    }
+
+    void OpenGLContext::useProgram(unsigned int program) const {
+        if (_stateCache.program == program) { ++_stateCache.droppedCalls; return; }
+        glUseProgram(program);
+        TT_RENDERING_STAT(++stats.stateChanges);
+        _stateCache.program = program;
+    }
+
+    void OpenGLContext::bindVertexArray(unsigned int vertexArray) const {
+        if (_stateCache.vertexArray == vertexArray) { ++_stateCache.droppedCalls; return; }
+        glBindVertexArray(vertexArray);
+        TT_RENDERING_STAT(++stats.stateChanges);
+        _stateCache.vertexArray = vertexArray;
+    }
+
+    void OpenGLContext::bindFramebuffer(unsigned int framebuffer) const {
+        if (_stateCache.framebuffer == framebuffer) { ++_stateCache.droppedCalls; return; }
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        TT_RENDERING_STAT(++stats.stateChanges);
+        _stateCache.framebuffer = framebuffer;
+    }
+
+    void OpenGLContext::bindTexture(unsigned int unit, unsigned int texture) const {
+        if (unit < StateCache::maxTextureUnits && _stateCache.textures[unit] == texture) { ++_stateCache.droppedCalls; return; }
+        if (_stateCache.activeTexture != unit) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            _stateCache.activeTexture = unit;
+        } else {
+            ++_stateCache.droppedCalls;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        TT_RENDERING_STAT(++stats.stateChanges);
+        if (unit < StateCache::maxTextureUnits)
+            _stateCache.textures[unit] = texture;
+    }
+
+    void OpenGLContext::bindBufferRange(unsigned int target, unsigned int index, unsigned int buffer, size_t offset, size_t size) const {
+        StateCache::BufferRange* cached = nullptr;
+        if (index < StateCache::maxBufferBindings)
+            cached = (target == GL_UNIFORM_BUFFER) ? &_stateCache.uniformBuffers[index] : &_stateCache.storageBuffers[index];
+        if (cached && cached->buffer == buffer && cached->offset == offset && cached->size == size) { ++_stateCache.droppedCalls; return; }
+        if (size == 0) {
+            glBindBufferBase(target, index, buffer);
+        } else {
+            glBindBufferRange(target, index, buffer, offset, size);
+        }
+        TT_RENDERING_STAT(++stats.stateChanges);
+        TT_RENDERING_STAT(if (target == GL_SHADER_STORAGE_BUFFER) ++stats.storageBufferBinds;)
+        if (cached)
+            *cached = { buffer, offset, size };
+    }
+
+    void OpenGLContext::setBlend(bool enabled) const {
+        if (_stateCache.blend == (unsigned int)enabled) { ++_stateCache.droppedCalls; return; }
+        if (enabled) {
+            glEnable(GL_BLEND);
+        } else {
+            glDisable(GL_BLEND);
         }
+        TT_RENDERING_STAT(++stats.stateChanges);
+        _stateCache.blend = (unsigned int)enabled;
+    }
+
+    void OpenGLContext::setDepthMask(bool enabled) const {
+        if (_stateCache.depthMask == (unsigned int)enabled) { ++_stateCache.droppedCalls; return; }
+        glDepthMask(enabled);
+        TT_RENDERING_STAT(++stats.stateChanges);
+        _stateCache.depthMask = (unsigned int)enabled;
+    }
+
+    void OpenGLContext::setBlendFunc(unsigned int src, unsigned int dst) const {
+        if (_stateCache.blendSrc == src && _stateCache.blendDst == dst) { ++_stateCache.droppedCalls; return; }
+        glBlendFunc(src, dst);
+        TT_RENDERING_STAT(++stats.stateChanges);
+        _stateCache.blendSrc = src;
+        _stateCache.blendDst = dst;
+    }
+
+    void OpenGLContext::flushMaterial(const MaterialHandle& material) const {
+        TT::assert(!material._resources || material.isLive(), "Drawing with a deleted material.");
+        if (!material.isLive())
+            return;
+        UniformResources* resources = material._resources;
+        if (!resources->uniformBuffer || resources->dirtyBegin == resources->dirtyEnd)
+            return;
+        if (resources->gpuOffset == (size_t)-1) {
+            GLuint oldBuffer;
+            resources->gpuOffset = materialArena.allocate(material.size(), oldBuffer);
+            if (oldBuffer)
+                retireQueue.current.buffers.push_back(oldBuffer);
+            // A new slice holds garbage, so all of it must be uploaded.
+            resources->markDirty(0, material.size());
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, materialArena.buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, resources->gpuOffset + resources->dirtyBegin, resources->dirtyEnd - resources->dirtyBegin, resources->uniformBuffer + resources->dirtyBegin);
+        TT_RENDERING_STAT(stats.uniformBytesUploaded += resources->dirtyEnd - resources->dirtyBegin);
+        resources->dirtyBegin = resources->dirtyEnd = 0;
     }
 
     const UniformInfo* OpenGLContext::useAndPrepareShader(const ShaderHandle& handle) const {
         // Enable shader
-        glUseProgram((GLuint)handle.identifier());
+        useProgram((GLuint)handle.identifier());
         // Get material uniform block info for this shader
-        const UniformInfo* uniformInfo = materialUniformInfo(handle);
-        // Allocate enough space
-        bindAndAllocateMaterialUBO(uniformInfo);
-        return uniformInfo;
+        return materialUniformInfo(handle);
     }
     
     void OpenGLContext::applyMaterialBlendMode(const MaterialHandle& material) const {
@@ -546,24 +1362,24 @@ namespace TTRendering {
         switch (blendMode) {
         case TTRendering::MaterialBlendMode::Opaque:
         case TTRendering::MaterialBlendMode::AlphaTest:
-            glDisable(GL_BLEND); TT_GL_DBG_ERR;
-            glDepthMask(true); TT_GL_DBG_ERR;
-            // glBlendFunc(GL_ONE, GL_ZERO);
+            setBlend(false);
+            setDepthMask(true);
+            // setBlendFunc(GL_ONE, GL_ZERO);
             break;
         case TTRendering::MaterialBlendMode::Alpha:
-            glEnable(GL_BLEND); TT_GL_DBG_ERR;
-            glDepthMask(false); TT_GL_DBG_ERR;
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); TT_GL_DBG_ERR;
+            setBlend(true);
+            setDepthMask(false);
+            setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
             break;
         case TTRendering::MaterialBlendMode::PremultipliedAlpha:
-            glEnable(GL_BLEND); TT_GL_DBG_ERR;
-            glDepthMask(false); TT_GL_DBG_ERR;
-            glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); TT_GL_DBG_ERR;
+            setBlend(true);
+            setDepthMask(false);
+            setBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
             break;
         case TTRendering::MaterialBlendMode::Additive:
-            glEnable(GL_BLEND); TT_GL_DBG_ERR;
-            glDepthMask(false); TT_GL_DBG_ERR;
-            glBlendFunc(GL_ONE, GL_ONE); TT_GL_DBG_ERR;
+            setBlend(true);
+            setDepthMask(false);
+            setBlendFunc(GL_ONE, GL_ONE);
             break;
         default:
             TT::assertFatal(false);
@@ -572,32 +1388,37 @@ namespace TTRendering {
 
     void OpenGLContext::uploadMaterial(const UniformInfo* uniformInfo, const MaterialHandle& material) const {
         if (uniformInfo) {
-            // Copy the data into the buffer
-            glBindBuffer(GL_UNIFORM_BUFFER, materialUbo);
-            TT::assert(material._resources != nullptr && material._resources->uniformBuffer != nullptr);
-            TT::assert(uniformInfo->bufferSize <= materialUboSize);
-            glBufferSubData(GL_UNIFORM_BUFFER, 0, uniformInfo->bufferSize, material._resources->uniformBuffer);
-            // Map only the used portion of the buffer
-            glBindBufferRange(GL_UNIFORM_BUFFER, (GLuint)UniformBlockSemantics::Material, materialUbo, 0, uniformInfo->bufferSize);
+            TT::assert(material.isLive() && material._resources->uniformBuffer != nullptr);
+            if (!material.isLive()) return;
+            // No-op when drawing a pass, which flushes all of its materials up front.
+            flushMaterial(material);
+            bindBufferRange(GL_UNIFORM_BUFFER, (GLuint)UniformBlockSemantics::Material, materialArena.buffer, material._resources->gpuOffset, uniformInfo->bufferSize);
         }
     }
 
     void OpenGLContext::bindMaterialImages(const MaterialHandle& material, size_t shaderIdentifier) const {
-        if (material._resources == nullptr) return;
-        unsigned int activeImage = 0;
+        if (!material.isLive()) return;
+        // Sampler uniforms got their texture unit when the shader was linked
+        const SamplerInfo* samplers = samplerInfo(shaderIdentifier);
+        if (samplers == nullptr) return;
         for(const auto& pair : material._resources->images) {
-            glActiveTexture(GL_TEXTURE0 + activeImage);
-            glBindTexture(GL_TEXTURE_2D, (GLuint)material._resources->images.handle(pair.second).identifier()); TT_GL_DBG_ERR;
-            GLint loc = glGetUniformLocation((GLuint)shaderIdentifier, pair.first.data());
-            glUniform1i(loc, activeImage);
-            ++activeImage;
+            const unsigned int* unit = samplers->find(pair.first);
+            // Images the shader does not use are not bound
+            if (unit == nullptr) continue;
+            bindTexture(*unit, (GLuint)pair.second.identifier()); TT_GL_DBG_ERR;
         }
     }
 
     void OpenGLContext::bindMaterialSSBOs(const MaterialHandle& material) const {
-        if (material._resources == nullptr) return;
+        if (!material.isLive()) return;
         for(const auto& pair : material._resources->ssbos) {
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (GLuint)pair.first, (GLuint)material._resources->ssbos.handle(pair.second).identifier());
+            // Stream buffers are bound at their active region
+            GLuint buffer = (GLuint)pair.second.identifier();
+            if (streamBuffers.buffers.count(buffer)) {
+                bindBufferRange(GL_SHADER_STORAGE_BUFFER, (GLuint)pair.first, buffer, streamBuffers.offset(buffer), pair.second.size());
+            } else {
+                bindBufferRange(GL_SHADER_STORAGE_BUFFER, (GLuint)pair.first, buffer);
+            }
         }
     }
 
@@ -608,21 +1429,355 @@ namespace TTRendering {
         bindMaterialSSBOs(material);
     }
 
-    void OpenGLContext::framebufferSize(const FramebufferHandle& framebuffer, unsigned int& width, unsigned int& height) const {
-        if(framebuffer._depthStencilAttachment != ImageHandle::Null)
-            return imageSize(framebuffer._depthStencilAttachment, width, height);
-        TT::assert(framebuffer._colorAttachments.size() > 0);
-        return imageSize(framebuffer._colorAttachments[0], width, height);
+    PassDraw OpenGLContext::resolveDraw(const DrawInfo& drawInfo) const {
+        const MeshHandle* meshH = meshes.find(drawInfo.meshIdentifier);
+        TT::assertFatal(meshH != nullptr);
+        const MeshHandle& mesh = *meshH;
+        return {
+            mesh._vertexArray,
+            glPrimitiveType(mesh.primitiveType()),
+            mesh.indexBuffer() != nullptr ? glIndexType(mesh.indexType()) : 0,
+            mesh.numElements(),
+            mesh.baseVertex(),
+            mesh.firstIndex(),
+            drawInfo.instanceCount,
+            drawInfo.pushConstants,
+            drawInfo.indirectBuffer
+        };
+    }
+
+    void OpenGLContext::drawMesh(const PassDraw& draw) const {
+        bindVertexArray((GLuint)draw.vertexArray);
+
+        if(draw.pushConstants)
+            bindBufferRange(GL_UNIFORM_BUFFER, (GLuint)UniformBlockSemantics::PushConstants, pushConstantsRing.buffer, pushConstantsRing.next(), sizeof(PushConstants));
+
+        if (draw.indirectBuffer) {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, (GLuint)draw.indirectBuffer);
+            const void* command = (const void*)streamBuffers.offset((GLuint)draw.indirectBuffer);
+            if (draw.indexType) {
+                glDrawElementsIndirect(draw.primitiveType, draw.indexType, command);
+            } else {
+                glDrawArraysIndirect(draw.primitiveType, command);
+            }
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+        else if (draw.indexType) {
+            // Meshes of the mesh arena start somewhere in a shared buffer
+            const void* indices = indexOffset(draw.indexType, draw.firstIndex);
+            if(draw.instanceCount > 0) {
+                glDrawElementsInstancedBaseVertex(draw.primitiveType, (GLsizei)draw.numElements, draw.indexType, indices, (GLsizei)draw.instanceCount, (GLint)draw.baseVertex);
+            } else {
+                glDrawElementsBaseVertex(draw.primitiveType, (GLsizei)draw.numElements, draw.indexType, indices, (GLint)draw.baseVertex);
+            }
+            TT_GL_DBG_ERR;
+        }
+        else {
+            if(draw.instanceCount > 0) {
+                glDrawArraysInstanced(draw.primitiveType, (GLint)draw.baseVertex, (GLsizei)draw.numElements, (GLsizei)draw.instanceCount);
+            } else {
+                glDrawArrays(draw.primitiveType, (GLint)draw.baseVertex, (GLsizei)draw.numElements);
+            }
+            TT_GL_DBG_ERR;
+        }
+
+        TT_RENDERING_STAT(++stats.drawCalls);
+        TT_RENDERING_STAT(if (draw.instanceCount > 0) ++stats.instancedDraws;)
+        TT_RENDERING_STAT(if (!draw.indirectBuffer) stats.triangles += triangleCount(draw.primitiveType, draw.numElements, draw.instanceCount);)
+    }
+
+    size_t OpenGLContext::multiDrawRunLength(const std::vector<const DrawInfo*>& draws, size_t begin) const {
+        // Draws can share a multi draw call when they share a vertex array object, like the meshes of an arena page and layout.
+        // Indirect draws already come with their own command.
+        if (draws[begin]->indirectBuffer)
+            return 1;
+        const MeshHandle* first = meshes.find(draws[begin]->meshIdentifier);
+        TT::assertFatal(first != nullptr);
+        size_t end = begin + 1;
+        for (; end < draws.size(); ++end) {
+            const MeshHandle* next = meshes.find(draws[end]->meshIdentifier);
+            TT::assertFatal(next != nullptr);
+            const MeshHandle& mesh = *next;
+            if (draws[end]->indirectBuffer ||
+                mesh._vertexArray != first->_vertexArray ||
+                mesh._vertexBuffer != first->_vertexBuffer ||
+                mesh._indexBuffer != first->_indexBuffer ||
+                mesh._instanceBuffer != first->_instanceBuffer ||
+                mesh._primitiveType != first->_primitiveType ||
+                mesh._indexType != first->_indexType)
+                break;
+        }
+        return end - begin;
+    }
+
+    size_t OpenGLContext::instanceRunLength(const std::vector<const DrawInfo*>& draws, size_t begin) const {
+        if (!instanceable(*draws[begin]))
+            return 1;
+        size_t end = begin + 1;
+        while (end < draws.size() && instanceable(*draws[end]) && draws[end]->meshIdentifier == draws[begin]->meshIdentifier)
+            ++end;
+        return end - begin;
+    }
+
+    void OpenGLContext::compilePass(const RenderPass& pass) const {
+        CommandList& list = pass._commandList;
+        list.clear();
+        list.resourceGeneration = resourceGeneration;
+        if (pass._drawQueueMode == DrawQueueMode::Sorted)
+            pass._drawList.sort();
+        bool multiDraw = list.multiDraw = pass._multiDrawIndirect;
+        bool instancing = list.instancing = pass._autoInstancing;
+        bool depthSorting = pass._depthSorting;
+
+        auto addDraw = [&](const DrawInfo& draw) {
+            const MeshHandle* mesh = meshes.find(draw.meshIdentifier);
+            TT::assertFatal(mesh != nullptr);
+            // Mesh bounds do not cover instances, those are culled on the GPU if at all.
+            const Bounds* bounds = mesh->bounds();
+            if (bounds && draw.instanceCount == 0 && draw.indirectBuffer == 0) {
+                list.boundedDraws.push_back(list.draws.size());
+                list.bounds.push_back(*bounds);
+            }
+            list.draws.push_back(resolveDraw(draw));
+        };
+
+        size_t currentShader = (size_t)-1;
+        forEachBucket(pass, [&](const ShaderHandle& shader, const MaterialHandle& material, bool, const std::vector<const DrawInfo*>& draws) {
+            MaterialBlendMode blendMode = material.blendMode();
+            if (depthSorting && (blendMode == MaterialBlendMode::Alpha || blendMode == MaterialBlendMode::PremultipliedAlpha || blendMode == MaterialBlendMode::Additive)) {
+                // Blended draws are sorted across buckets, so each one carries its own state.
+                size_t shaderIndex = list.shaders.size();
+                list.shaders.push_back({ shader.identifier(), materialUniformInfo(shader) });
+                size_t materialIndex = list.materials.size();
+                list.materials.push_back(material);
+                for (const DrawInfo* draw : draws) {
+                    list.blendedDraws.push_back({ shaderIndex, materialIndex, list.draws.size() });
+                    addDraw(*draw);
+                }
+                return;
+            }
+
+            if (shader.identifier() != currentShader) {
+                list.commands.push_back({ CommandList::Op::UseShader, 1, list.shaders.size() });
+                list.shaders.push_back({ shader.identifier(), materialUniformInfo(shader) });
+                currentShader = shader.identifier();
+            }
+            list.commands.push_back({ CommandList::Op::BindMaterial, 1, list.materials.size() });
+            list.materials.push_back(material);
+
+            if (depthSorting) {
+                list.commands.push_back({ CommandList::Op::SortedDraws, (unsigned int)draws.size(), list.draws.size() });
+                for (const DrawInfo* draw : draws)
+                    addDraw(*draw);
+                return;
+            }
+
+            for (size_t i = 0; i < draws.size();) {
+                CommandList::Op op = CommandList::Op::Draw;
+                size_t count = instancing ? instanceRunLength(draws, i) : 1;
+                if (instancing && instanceable(*draws[i])) {
+                    // Even single draws, the shaders of the pass only read push constants through gl_BaseInstance.
+                    op = CommandList::Op::InstancedDraw;
+                } else if (multiDraw) {
+                    // Even single draws, the shaders of the pass only read push constants through gl_DrawID.
+                    count = multiDrawRunLength(draws, i);
+                    op = CommandList::Op::MultiDraw;
+                }
+                list.commands.push_back({ op, (unsigned int)count, list.draws.size() });
+                for (size_t j = i; j < i + count; ++j)
+                    addDraw(*draws[j]);
+                i += count;
+            }
+        });
+        pass.modified = false;
+    }
+
+    void OpenGLContext::stageSingleDraw(const CommandList& list, size_t i) const {
+        const PassDraw& draw = list.draws[i];
+        if (list.instancing && draw.instanceCount == 0 && draw.indirectBuffer == 0) {
+            autoInstancing.add(draw);
+        } else if (list.multiDraw) {
+            multiDrawIndirect.beginBatch();
+            multiDrawIndirect.add(draw);
+        } else {
+            pushConstantsRing.stage(draw.pushConstants);
+        }
+    }
+
+    void OpenGLContext::drawSingle(const CommandList& list, size_t i) const {
+        const PassDraw& draw = list.draws[i];
+        if (list.instancing && draw.instanceCount == 0 && draw.indirectBuffer == 0) {
+            bindVertexArray((GLuint)draw.vertexArray);
+            autoInstancing.draw(draw, 1);
+            TT_RENDERING_STAT(++stats.instancedDraws);
+        } else if (list.multiDraw) {
+            bindVertexArray((GLuint)draw.vertexArray);
+            size_t offset = multiDrawIndirect.nextPushConstantsOffset();
+            bindBufferRange(GL_SHADER_STORAGE_BUFFER, (GLuint)StorageBufferSemantics::DrawPushConstants, multiDrawIndirect.pushConstantsBuffer, offset, sizeof(PushConstants));
+            if (draw.indirectBuffer) {
+                multiDrawIndirect.drawIndirect(draw, streamBuffers.offset((GLuint)draw.indirectBuffer));
+            } else {
+                multiDrawIndirect.draw(draw, 1);
+            }
+        } else {
+            drawMesh(draw);
+            return;
+        }
+        TT_RENDERING_STAT(++stats.drawCalls);
+        TT_RENDERING_STAT(if (!draw.indirectBuffer) stats.triangles += triangleCount(draw.primitiveType, draw.numElements, draw.instanceCount);)
+    }
+
+    void OpenGLContext::replayPass(const CommandList& list) const {
+        // Upload all push constants and changed material uniforms of this pass at once
+        pushConstantsRing.beginPass();
+        multiDrawIndirect.beginPass();
+        autoInstancing.beginPass();
+        for (const CommandList::Command& command : list.commands) {
+            switch (command.op) {
+            case CommandList::Op::BindMaterial:
+                flushMaterial(list.materials[command.argument]);
+                break;
+            case CommandList::Op::Draw:
+                if (list.isVisible(command.argument))
+                    stageSingleDraw(list, command.argument);
+                break;
+            case CommandList::Op::MultiDraw:
+                // Culled draws are left out of the batch, an empty batch is skipped when drawing.
+                multiDrawIndirect.beginBatch();
+                for (size_t i = command.argument; i < command.argument + command.count; ++i) {
+                    if (list.isVisible(i))
+                        multiDrawIndirect.add(list.draws[i]);
+                }
+                break;
+            case CommandList::Op::InstancedDraw:
+                for (size_t i = command.argument; i < command.argument + command.count; ++i) {
+                    if (list.isVisible(i))
+                        autoInstancing.add(list.draws[i]);
+                }
+                break;
+            case CommandList::Op::SortedDraws:
+                for (size_t i = command.argument; i < command.argument + command.count; ++i) {
+                    size_t draw = list.sortedDraw(i);
+                    if (list.isVisible(draw))
+                        stageSingleDraw(list, draw);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        for (size_t i = 0; i < list.blendedDraws.size(); ++i) {
+            const CommandList::BlendedDraw& blended = list.blendedDraw(i);
+            flushMaterial(list.materials[blended.material]);
+            if (list.isVisible(blended.draw))
+                stageSingleDraw(list, blended.draw);
+        }
+        // Push constants of multi draws and automatic instances go to storage buffers, they count all the same.
+        TT_RENDERING_STAT(stats.uniformBytesUploaded += pushConstantsRing.staging.size());
+        TT_RENDERING_STAT(stats.uniformBytesUploaded += (multiDrawIndirect.pushConstants.size() + autoInstancing.pushConstants.size()) * sizeof(PushConstants));
+        if (GLuint oldBuffer = pushConstantsRing.upload())
+            retireQueue.current.buffers.push_back(oldBuffer);
+        multiDrawIndirect.upload();
+        if (autoInstancing.upload())
+            bindBufferRange(GL_SHADER_STORAGE_BUFFER, (GLuint)StorageBufferSemantics::InstancePushConstants, autoInstancing.buffer);
+
+        const CommandList::Shader* shader = nullptr;
+        for (const CommandList::Command& command : list.commands) {
+            switch (command.op) {
+            case CommandList::Op::UseShader:
+                shader = &list.shaders[command.argument];
+                useProgram((GLuint)shader->identifier);
+                break;
+            case CommandList::Op::BindMaterial:
+                bindMaterialResources(shader->materialUniformInfo, list.materials[command.argument], shader->identifier);
+                break;
+            case CommandList::Op::Draw:
+                if (list.isVisible(command.argument))
+                    drawSingle(list, command.argument);
+                break;
+            case CommandList::Op::MultiDraw: {
+                size_t count = 0;
+                for (size_t i = command.argument; i < command.argument + command.count; ++i) {
+                    if (!list.isVisible(i)) continue;
+                    ++count;
+                    TT_RENDERING_STAT(if (!list.draws[i].indirectBuffer) stats.triangles += triangleCount(list.draws[i].primitiveType, list.draws[i].numElements, list.draws[i].instanceCount));
+                }
+                if (count == 0) break;
+                // All draws of the batch share their buffers, so the first one's vertex array works for all.
+                const PassDraw& first = list.draws[command.argument];
+                bindVertexArray((GLuint)first.vertexArray);
+                size_t offset = multiDrawIndirect.nextPushConstantsOffset();
+                bindBufferRange(GL_SHADER_STORAGE_BUFFER, (GLuint)StorageBufferSemantics::DrawPushConstants, multiDrawIndirect.pushConstantsBuffer, offset, count * sizeof(PushConstants));
+                if (first.indirectBuffer) {
+                    multiDrawIndirect.drawIndirect(first, streamBuffers.offset((GLuint)first.indirectBuffer));
+                } else {
+                    multiDrawIndirect.draw(first, count);
+                }
+                TT_RENDERING_STAT(++stats.drawCalls);
+                break;
+            }
+            case CommandList::Op::InstancedDraw: {
+                size_t count = 0;
+                for (size_t i = command.argument; i < command.argument + command.count; ++i)
+                    count += list.isVisible(i) ? 1 : 0;
+                if (count == 0) break;
+                const PassDraw& first = list.draws[command.argument];
+                bindVertexArray((GLuint)first.vertexArray);
+                autoInstancing.draw(first, count);
+                TT_RENDERING_STAT(++stats.drawCalls);
+                TT_RENDERING_STAT(++stats.instancedDraws);
+                TT_RENDERING_STAT(stats.triangles += triangleCount(first.primitiveType, first.numElements, count));
+                break;
+            }
+            case CommandList::Op::SortedDraws:
+                for (size_t i = command.argument; i < command.argument + command.count; ++i) {
+                    size_t draw = list.sortedDraw(i);
+                    if (list.isVisible(draw))
+                        drawSingle(list, draw);
+                }
+                break;
+            }
+        }
+
+        size_t currentShader = (size_t)-1;
+        size_t currentMaterial = (size_t)-1;
+        for (size_t i = 0; i < list.blendedDraws.size(); ++i) {
+            const CommandList::BlendedDraw& blended = list.blendedDraw(i);
+            if (!list.isVisible(blended.draw)) continue;
+            if (blended.shader != currentShader) {
+                useProgram((GLuint)list.shaders[blended.shader].identifier);
+                currentShader = blended.shader;
+                currentMaterial = (size_t)-1;
+            }
+            if (blended.material != currentMaterial) {
+                const CommandList::Shader& blendedShader = list.shaders[blended.shader];
+                bindMaterialResources(blendedShader.materialUniformInfo, list.materials[blended.material], blendedShader.identifier);
+                currentMaterial = blended.material;
+            }
+            drawSingle(list, blended.draw);
+        }
+
+        pushConstantsRing.endPass();
     }
 
 	void OpenGLContext::drawPass(const RenderPass& pass, unsigned int defaultFramebuffer) {
+        TT_PROFILE_SCOPE("drawPass");
+        TT_RENDERING_STAT(++stats.passes);
+        const bool timed = !pass._gpuTimerName.empty();
+        if (timed) {
+            // Without frames nobody else reads back the results, and the pool would grow forever.
+            if (!_windowsGLContext)
+                collectGpuTimings();
+            gpuTimerQueries.begin(pass._gpuTimerName);
+        }
+
         if (pass._framebuffer == FramebufferHandle::Null) {
-            glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebuffer);
+            bindFramebuffer(defaultFramebuffer);
             unsigned int w, h; 
             resolution(w, h);
             glViewport(0, 0, w, h); TT_GL_DBG_ERR;
         } else {
-            glBindFramebuffer(GL_FRAMEBUFFER, (GLuint)pass._framebuffer.identifier());
+            bindFramebuffer((GLuint)pass._framebuffer.identifier());
             unsigned int width, height;
             framebufferSize(pass._framebuffer, width, height);
             glViewport(0, 0, width, height); TT_GL_DBG_ERR;
@@ -646,104 +1801,98 @@ namespace TTRendering {
 				passUboSize = requiredBufferSize;
 			}
 			glBufferSubData(GL_UNIFORM_BUFFER, 0, requiredBufferSize, pass.passUniforms.cpuBuffer());
-			glBindBufferRange(GL_UNIFORM_BUFFER, (GLuint)UniformBlockSemantics::Pass, passUbo, 0, requiredBufferSize);
+			TT_RENDERING_STAT(stats.uniformBytesUploaded += requiredBufferSize);
+			bindBufferRange(GL_UNIFORM_BUFFER, (GLuint)UniformBlockSemantics::Pass, passUbo, 0, requiredBufferSize);
 		}
 
-		for (size_t meshLayoutIndex = 0; meshLayoutIndex < pass._drawQueue.keys.size(); ++meshLayoutIndex) {
-			size_t meshLayoutHash = pass._drawQueue.keys[meshLayoutIndex];
-			const auto& shaderQueue = pass._drawQueue.queues[meshLayoutIndex];
-			for (size_t shaderIndex = 0; shaderIndex < shaderQueue.keys.size(); ++shaderIndex) {
-				size_t shaderIdentifier = shaderQueue.keys[shaderIndex].identifier();
-
-                const UniformInfo* uniformInfo = useAndPrepareShader((GLuint)shaderIdentifier);
-
-				const auto& materialQueue = shaderQueue.queues[shaderIndex];
-				for (size_t materialIndex = 0; materialIndex < materialQueue.keys.size(); ++materialIndex) {
-					const MaterialHandle& material = materialQueue.keys[materialIndex];
-
-                    bindMaterialResources(uniformInfo, material, shaderIdentifier);
-
-                    glBindBuffer(GL_UNIFORM_BUFFER, pushConstantsUbo);
-
-					const auto& meshQueue = materialQueue.queues[materialIndex];
-					for (const auto& pair : meshQueue) {
-                        const auto& [meshIdentifier, instanceCount, pushConstants] = pair.second;
-						const MeshHandle* meshH = meshes.find(meshIdentifier);
-						TT::assertFatal(meshH != nullptr);
-						const MeshHandle& mesh = *meshH;
-						glBindVertexArray((GLuint)mesh.identifier());
-
-						if(pushConstants)
-							glBufferData(GL_UNIFORM_BUFFER, sizeof(PushConstants), pushConstants, GL_DYNAMIC_DRAW);
-
-						if (mesh.indexBuffer() != nullptr) {
-                            if(instanceCount > 0) {
-                                glDrawElementsInstanced(glPrimitiveType(mesh.primitiveType()), (GLsizei)mesh.numElements(), glIndexType(mesh.indexType()), nullptr, (GLsizei)instanceCount);
-                            } else {
-							    glDrawElements(glPrimitiveType(mesh.primitiveType()), (GLsizei)mesh.numElements(), glIndexType(mesh.indexType()), nullptr);
-                            }
-							TT_GL_DBG_ERR;
-						}
-						else {
-                            if(instanceCount > 0) {
-							    glDrawArraysInstanced(glPrimitiveType(mesh.primitiveType()), 0, (GLsizei)mesh.numElements(), (GLsizei)instanceCount);
-                            } else {
-							    glDrawArrays(glPrimitiveType(mesh.primitiveType()), 0, (GLsizei)mesh.numElements());
-                            }
-							TT_GL_DBG_ERR;
-						}
-					}
-				}
-			}
-		}
+        // Unchanged passes are replayed from the commands compiled when they were last drawn.
+        if (pass.modified || pass._commandList.resourceGeneration != resourceGeneration)
+            compilePass(pass);
+        if (pass._frustumCulling)
+            pass._commandList.cull(pass._cullingViewProjection);
+        else
+            pass._commandList.visibility.clear();
+        if (pass._depthSorting)
+            pass._commandList.sortByDepth(pass._depthReference);
+        replayPass(pass._commandList);
 
-		glBindVertexArray(0);
+        // Leave the default state behind for whoever draws next
+		bindVertexArray(0);
 		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-		glUseProgram(0);
-		glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebuffer);
-        glDisable(GL_BLEND);
-        glDepthMask(true);
+		useProgram(0);
+		bindFramebuffer(defaultFramebuffer);
+        setBlend(false);
+        setDepthMask(true);
+
+        if (timed)
+            gpuTimerQueries.end();
 	}
 
-    void OpenGLContext::dispatchCompute(const MaterialHandle& material, unsigned int x, unsigned int y, unsigned int z) {
+    void OpenGLContext::dispatchCompute(const MaterialHandle& material, unsigned int x, unsigned int y, unsigned int z, const char* gpuTimerName) {
+        if (gpuTimerName) {
+            if (!_windowsGLContext)
+                collectGpuTimings();
+            gpuTimerQueries.begin(gpuTimerName);
+        }
         size_t shaderIdentifier = material.shader().identifier();
         const UniformInfo* uniformInfo = useAndPrepareShader((GLuint)shaderIdentifier);
         bindMaterialResources(uniformInfo, material, shaderIdentifier);
         glDispatchCompute(x, y, z);
         glMemoryBarrier(GL_ALL_BARRIER_BITS);
+        if (gpuTimerName)
+            gpuTimerQueries.end();
+        TT_RENDERING_STAT(++stats.computeDispatches);
         // Remnant to verify written data:
         // float* points = (float*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
         // glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
     }
 
+    // The GL objects themselves are deleted by drainRetireQueue, once the frames that may use them are done.
 	void OpenGLContext::deleteBuffer(const BufferHandle& buffer) {
-		GLuint handle = (GLuint)buffer.identifier();
-		glDeleteBuffers(1, &handle);
+        // Deleting the buffer also unmaps it.
+        streamBuffers.buffers.erase((GLuint)buffer.identifier());
+        retireQueue.current.buffers.push_back((GLuint)buffer.identifier());
+        if (!_windowsGLContext) drainRetireQueue(true);
 	}
 
 	void OpenGLContext::deleteMesh(const MeshHandle& mesh) {
-		GLuint handle = (GLuint)mesh.identifier();
-		glDeleteVertexArrays(1, &handle);
+        // Arena meshes only give back their range, the vertex array belongs to the page.
+        if (!releaseArenaMesh(mesh)) {
+            retireQueue.current.vertexArrays.push_back((GLuint)mesh.identifier());
+            streamBuffers.vertexArrays.erase((GLuint)mesh.identifier());
+        }
         deregisterMesh(mesh);
+        if (!_windowsGLContext) drainRetireQueue(true);
 	}
 
     void OpenGLContext::deleteShaderStage(const ShaderStageHandle& stage) {
-        glDeleteShader((GLuint)stage.identifier());
+        retireQueue.current.shaders.push_back((GLuint)stage.identifier());
         deregisterShaderStage(stage);
+        if (!_windowsGLContext) drainRetireQueue(true);
     }
 
     void OpenGLContext::deleteShader(const ShaderHandle& shader) {
-        glDeleteProgram((GLuint)shader.identifier());
+        retireQueue.current.programs.push_back((GLuint)shader.identifier());
         deregisterShader(shader);
+        if (!_windowsGLContext) drainRetireQueue(true);
+    }
+
+    void OpenGLContext::deleteMaterialStorage(const MaterialHandle& material) {
+        UniformResources* resources = material._resources;
+        if (resources && resources->gpuOffset != (size_t)-1) {
+            materialArena.free(resources->gpuOffset, material.size());
+            resources->gpuOffset = (size_t)-1;
+        }
     }
 
     void OpenGLContext::deleteImage(const ImageHandle& image) {
-        GLuint handle = (GLuint)image.identifier();
-        glDeleteTextures(1, &handle);
+        imageExtents.erase(image.identifier());
+        retireQueue.current.textures.push_back((GLuint)image.identifier());
+        if (!_windowsGLContext) drainRetireQueue(true);
     }
 
     void OpenGLContext::deleteFramebuffer(const FramebufferHandle& frameBuffer) {
-        GLuint handle = (GLuint)frameBuffer.identifier();
-        glDeleteFramebuffers(1, &handle);
+        retireQueue.current.framebuffers.push_back((GLuint)frameBuffer.identifier());
+        if (!_windowsGLContext) drainRetireQueue(true);
     }
 }
@@ -5,9 +5,54 @@
 namespace TTRendering {
 	class OpenGLContext final : public RenderingContext {
 		HDC__* _windowsGLContext = nullptr;
+
+        // Shadow copy of the GL state we bind while drawing, so calls that would change nothing can be dropped.
+        struct StateCache {
+            static const unsigned int unknown = 0xFFFFFFFF;
+            static const unsigned int maxTextureUnits = 32;
+            static const unsigned int maxBufferBindings = 16;
+
+            struct BufferRange {
+                unsigned int buffer;
+                size_t offset;
+                size_t size; // 0 when bound with glBindBufferBase
+            };
+
+            unsigned int program;
+            unsigned int vertexArray;
+            unsigned int framebuffer;
+            unsigned int activeTexture;
+            unsigned int textures[maxTextureUnits];
+            unsigned int blend;
+            unsigned int depthMask;
+            unsigned int blendSrc;
+            unsigned int blendDst;
+            BufferRange uniformBuffers[maxBufferBindings];
+            BufferRange storageBuffers[maxBufferBindings];
+
+            size_t droppedCalls = 0;
+
+            StateCache() { invalidate(); }
+            void invalidate();
+            // Deleted GL names revert their bindings to 0 and may be handed out again, so we must forget them.
+            void forgetBuffer(unsigned int buffer);
+            void forgetTexture(unsigned int texture);
+        };
+        mutable StateCache _stateCache;
+
+        void useProgram(unsigned int program) const;
+        void bindVertexArray(unsigned int vertexArray) const;
+        void bindFramebuffer(unsigned int framebuffer) const;
+        void bindTexture(unsigned int unit, unsigned int texture) const;
+        void bindBufferRange(unsigned int target, unsigned int index, unsigned int buffer, size_t offset = 0, size_t size = 0) const;
+        void setBlend(bool enabled) const;
+        void setDepthMask(bool enabled) const;
+        void setBlendFunc(unsigned int src, unsigned int dst) const;
+
 		std::unordered_map<int, UniformInfo> getUniformBlocks(const ShaderHandle& shader, const std::vector<ShaderStageHandle>& stages) const override;
+		SamplerInfo getSamplers(const ShaderHandle& shader) const override;
 
-        void bindAndAllocateMaterialUBO(const UniformInfo* uniformInfo) const;
+        void flushMaterial(const MaterialHandle& material) const;
         void applyMaterialBlendMode(const MaterialHandle& material) const;
         void uploadMaterial(const UniformInfo* uniformInfo, const MaterialHandle& material) const;
         void bindMaterialImages(const MaterialHandle& material, size_t shaderIdentifier) const;
@@ -16,8 +61,22 @@ namespace TTRendering {
         const UniformInfo* useAndPrepareShader(const ShaderHandle& handle) const;
         void bindMaterialResources(const UniformInfo* uniformInfo, const MaterialHandle& material, size_t shaderIdentifier) const;
 
+        PassDraw resolveDraw(const DrawInfo& drawInfo) const;
+        void drawMesh(const PassDraw& draw) const;
+        size_t multiDrawRunLength(const std::vector<const DrawInfo*>& draws, size_t begin) const;
+        size_t instanceRunLength(const std::vector<const DrawInfo*>& draws, size_t begin) const;
+        void compilePass(const RenderPass& pass) const;
+        // A draw that is issued on its own, with its push constants where the shaders of the pass expect them.
+        void stageSingleDraw(const CommandList& list, size_t draw) const;
+        void drawSingle(const CommandList& list, size_t draw) const;
+        void collectGpuTimings();
+        // Deletes the GL objects of frames the GPU finished, or of all frames when forced.
+        void drainRetireQueue(bool force);
+        void replayPass(const CommandList& list) const;
+
 		ShaderStageHandle createShaderStage(const char* glslFilePath) override;
 		ShaderHandle createShader(const std::vector<ShaderStageHandle>& stages) override;
+		void deleteMaterialStorage(const MaterialHandle& material) override;
 
 	public:
         // This is useful when running in another framework, but it means beginFrame and endFrame do not work.
@@ -29,12 +88,22 @@ namespace TTRendering {
             for(const auto& pair : resourcePools) {
                 deleteResourcePoolInternal(ResourcePoolHandle(pair.first), false); 
             }
+            drainRetireQueue(true);
         }
 
+        // Forget all cached GL state. Call this whenever GL state may have been changed outside of this context,
+        // e.g. by the host framework when constructed without a window.
+        void invalidateStateCache() { _stateCache.invalidate(); }
+        // Number of redundant GL calls that were not issued thanks to the state cache.
+        size_t droppedStateChanges() const { return _stateCache.droppedCalls; }
+
 		void beginFrame() override;
 		void endFrame() override;
 
         BufferHandle createBuffer(size_t size, unsigned char* data = nullptr, BufferMode mode = BufferMode::StaticDraw, const ResourcePoolHandle* pool = nullptr) override;
+        void writeBuffer(const BufferHandle& buffer, const void* data, size_t size, size_t offset = 0) override;
+        void* mapForWrite(const BufferHandle& buffer) override;
+        void copyBuffer(const BufferHandle& source, size_t sourceOffset, const BufferHandle& destination, size_t destinationOffset, size_t size) override;
         MeshHandle createMesh(
             size_t numElements, // num vertices if indexData == nullptr, else num indices
             BufferHandle vertexData, 
@@ -46,13 +115,12 @@ namespace TTRendering {
             const std::vector<MeshAttribute>& instanceAttributeLayout = {}, 
             const ResourcePoolHandle* pool = nullptr) override; // ignored if numInstances == 0 or instanceData == nullptr
 		ImageHandle createImage(unsigned int width, unsigned int height, ImageFormat format, ImageInterpolation interpolation = ImageInterpolation::Linear, ImageTiling tiling = ImageTiling::Repeat, const unsigned char* data = nullptr, const ResourcePoolHandle* pool = nullptr) override;
-        void imageSize(const ImageHandle& image, unsigned int& width, unsigned int& height) const override;
-        void framebufferSize(const FramebufferHandle& framebuffer, unsigned int& width, unsigned int& height) const override;
+        void writeImageLevel(const ImageHandle& image, unsigned int level, const unsigned char* data) override;
 		void resizeImage(const ImageHandle& image, unsigned int width, unsigned int height) override;
 		void resizeFramebuffer(const FramebufferHandle& framebuffer, unsigned int width, unsigned int height) override;
 		FramebufferHandle createFramebuffer(const std::vector<ImageHandle>& colorAttachments, const ImageHandle* depthStencilAttachment, const ResourcePoolHandle* pool = nullptr) override;
 		void drawPass(const RenderPass& pass, unsigned int defaultFramebuffer = 0) override;
-        void dispatchCompute(const MaterialHandle& material, unsigned int x = 1, unsigned int y = 1, unsigned int z = 1) override;
+        void dispatchCompute(const MaterialHandle& material, unsigned int x = 1, unsigned int y = 1, unsigned int z = 1, const char* gpuTimerName = nullptr) override;
         void deleteBuffer(const BufferHandle& buffer) override;
         void deleteMesh(const MeshHandle& mesh) override;
         void deleteShaderStage(const ShaderStageHandle& mesh) override;
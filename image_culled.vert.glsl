@@ -0,0 +1,27 @@
+#version 450
+
+layout(std140, binding = 1) uniform PassInfo {
+	mat4 uVP;
+};
+
+// layout(std140, binding = 2) uniform MaterialInfo {};
+
+// Instances that survived culling.compute.glsl, bind the same buffers to the material of the draw.
+struct Instance {
+	mat4 modelMatrix;
+	vec4 boundsMin;
+	vec4 boundsMax;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { Instance uInstances[]; };
+layout(std430, binding = 1) readonly buffer VisibleInstances { uint uVisibleInstances[]; };
+
+layout(location = 0) in vec2 aPosition;
+
+layout(location = 0) out vec2 vUv;
+
+void main() {
+	mat4 uModelMatrix = uInstances[uVisibleInstances[gl_InstanceID]].modelMatrix;
+	gl_Position = uVP * uModelMatrix * vec4(aPosition, 0.0, 1.0);
+	vUv = vec2(aPosition.x, 1.0 - aPosition.y);
+}
@@ -0,0 +1,27 @@
+#version 460
+
+layout(std140, binding = 1) uniform PassInfo {
+	mat4 uVP;
+};
+
+// layout(std140, binding = 2) uniform MaterialInfo {};
+
+struct PushConstants {
+	mat4 uModelMatrix;
+	mat4 uExtraData;
+};
+
+// Multi draw indirect replacement of the push constants block, see RenderPass::setMultiDrawIndirect.
+layout(std430, binding = 7) readonly buffer DrawPushConstants {
+	PushConstants uDrawPushConstants[];
+};
+
+layout(location = 0) in vec2 aPosition;
+
+layout(location = 0) out vec2 vUv;
+
+void main() {
+	mat4 uModelMatrix = uDrawPushConstants[gl_DrawID].uModelMatrix;
+	gl_Position = uVP * uModelMatrix * vec4(aPosition, 0.0, 1.0);
+	vUv = vec2(aPosition.x, 1.0 - aPosition.y);
+}
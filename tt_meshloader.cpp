@@ -1,5 +1,6 @@
 #include "tt_meshloader.h"
 #include "../tt_cpplib/tt_files.h"
+#include "tt_profiler.h"
 
 namespace {
     std::string cachedFilePath(const std::string_view path) {
@@ -98,6 +99,7 @@ namespace TT {
     }
 
     bool FbxExtractor::loadFromCache(const std::string_view filePath) {
+        TT_PROFILE_SCOPE("FbxExtractor::loadFromCache");
         const std::string cacheFile = cachedFilePath(filePath);
 
         // compare write times
@@ -0,0 +1,139 @@
+#include "tt_profiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+    struct Event {
+        const char* name;
+        uint64_t begin;
+        uint64_t end;
+    };
+
+    // Only the owning thread appends. It publishes an event by bumping count after writing it,
+    // so the dumping thread can read everything below count without locking.
+    struct Chunk {
+        static const size_t capacity = 4096;
+        Event events[capacity];
+        std::atomic<size_t> count = 0;
+        std::atomic<Chunk*> next = nullptr;
+    };
+
+    struct ThreadBuffer {
+        static const size_t maxChunks = 256; // 1M zones per thread, later ones are dropped
+
+        size_t threadIndex;
+        Chunk* first;
+        Chunk* last;
+        size_t chunkCount = 1;
+
+        ThreadBuffer(size_t index) : threadIndex(index), first(new Chunk), last(first) {}
+        ~ThreadBuffer() {
+            Chunk* chunk = first;
+            while (chunk) {
+                Chunk* next = chunk->next.load();
+                delete chunk;
+                chunk = next;
+            }
+        }
+
+        void append(const Event& event) {
+            size_t count = last->count.load(std::memory_order_relaxed);
+            if (count == Chunk::capacity) {
+                if (chunkCount == maxChunks)
+                    return;
+                Chunk* chunk = new Chunk;
+                last->next.store(chunk, std::memory_order_release);
+                last = chunk;
+                ++chunkCount;
+                count = 0;
+            }
+            last->events[count] = event;
+            last->count.store(count + 1, std::memory_order_release);
+        }
+    };
+
+    // Buffers outlive their threads, so zones of finished threads still end up in the trace.
+    // The mutex is only taken when a thread records its first zone and when dumping.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> threads;
+        std::atomic<bool> enabled = false;
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    } registry;
+
+    thread_local ThreadBuffer* threadBuffer = nullptr;
+
+    ThreadBuffer& localBuffer() {
+        if (!threadBuffer) {
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(std::make_unique<ThreadBuffer>(registry.threads.size()));
+            threadBuffer = registry.threads.back().get();
+        }
+        return *threadBuffer;
+    }
+
+    void writeJsonString(std::ofstream& out, const char* text) {
+        out << '"';
+        for (const char* c = text; *c; ++c) {
+            if (*c == '"' || *c == '\\')
+                out << '\\';
+            out << *c;
+        }
+        out << '"';
+    }
+}
+
+namespace TTRendering {
+    namespace Profiler {
+        void setEnabled(bool enabled) {
+            registry.enabled.store(enabled, std::memory_order_relaxed);
+        }
+
+        bool enabled() {
+            return registry.enabled.load(std::memory_order_relaxed);
+        }
+
+        uint64_t now() {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - registry.start).count();
+        }
+
+        void record(const char* name, uint64_t begin, uint64_t end) {
+            localBuffer().append({ name, begin, end });
+        }
+
+        bool dumpChromeTrace(const char* filePath) {
+            std::ofstream out(filePath);
+            if (!out)
+                return false;
+            out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+            bool first = true;
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (const auto& thread : registry.threads) {
+                if (!first) out << ',';
+                first = false;
+                out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << thread->threadIndex
+                    << ",\"args\":{\"name\":\"Thread " << thread->threadIndex << "\"}}";
+                for (const Chunk* chunk = thread->first; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+                    size_t count = chunk->count.load(std::memory_order_acquire);
+                    for (size_t i = 0; i < count; ++i) {
+                        const Event& event = chunk->events[i];
+                        // Trace timestamps are in microseconds
+                        out << ",{\"name\":";
+                        writeJsonString(out, event.name);
+                        out << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread->threadIndex
+                            << ",\"ts\":" << (double)event.begin / 1000.0
+                            << ",\"dur\":" << (double)(event.end - event.begin) / 1000.0 << '}';
+                    }
+                }
+            }
+            out << "]}\n";
+            return (bool)out;
+        }
+    }
+}
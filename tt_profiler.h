@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+// Comment out to compile the profiling zones out of the renderer.
+#define TT_RENDERING_PROFILER
+
+namespace TTRendering {
+    // Scope profiler. Every thread records into its own buffer without taking locks, zones nest by time,
+    // so the hierarchy shows up in the trace viewer without being stored.
+    namespace Profiler {
+        // Zones record nothing while disabled, which is the default.
+        void setEnabled(bool enabled);
+        bool enabled();
+
+        // Writes all zones recorded so far as Chrome trace_event JSON, for chrome://tracing or Perfetto.
+        // Can be called while other threads are recording, zones that are still open are left out.
+        bool dumpChromeTrace(const char* filePath);
+
+        uint64_t now(); // nanoseconds since the profiler started
+        void record(const char* name, uint64_t begin, uint64_t end);
+    }
+
+    // Records the time between construction and destruction as a zone.
+    // The name is not copied, so it must outlive the profiler, e.g. a string literal.
+    class ProfileScope {
+        const char* _name;
+        uint64_t _begin;
+
+        ProfileScope(const ProfileScope&) = delete;
+        ProfileScope& operator=(const ProfileScope&) = delete;
+
+    public:
+        ProfileScope(const char* name) : _name(Profiler::enabled() ? name : nullptr), _begin(_name ? Profiler::now() : 0) {}
+        ~ProfileScope() { if (_name) Profiler::record(_name, _begin, Profiler::now()); }
+    };
+}
+
+#ifdef TT_RENDERING_PROFILER
+#define TT_PROFILE_CONCAT_INNER(a, b) a##b
+#define TT_PROFILE_CONCAT(a, b) TT_PROFILE_CONCAT_INNER(a, b)
+#define TT_PROFILE_SCOPE(name) TTRendering::ProfileScope TT_PROFILE_CONCAT(_profileScope, __LINE__)(name)
+#else
+#define TT_PROFILE_SCOPE(name)
+#endif
@@ -3,8 +3,14 @@
 #include "../../tt_cpplib/tt_messages.h"
 #include "stb/stb_image.h"
 #include "tt_meshloader.h"
+#include "tt_profiler.h"
 
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <xmmintrin.h>
 
 namespace TTRendering {
 	HandleBase::HandleBase(size_t identifier) : _identifier(identifier) {}
@@ -23,6 +29,7 @@ namespace TTRendering {
         BufferHandle* instanceBuffer) :
 		HandleBase(identifier),
         _meshLayoutHash(meshLayoutHash),
+		_vertexArray(identifier),
 		_vertexBuffer(vertexBuffer),
 		_numElements(numElements),
 		_primitiveType(primitiveType),
@@ -32,7 +39,8 @@ namespace TTRendering {
         if (instanceBuffer) _instanceBuffer = *instanceBuffer;
 
         _indexType = IndexType::None;
-        if(indexBuffer) {
+        // Vertex arrays of the mesh arena have an index buffer but no indices of their own.
+        if(indexBuffer && numElements > 0) {
             size_t indexElementSize = indexBuffer->size() / numElements;
             switch(indexElementSize) {
             case 1:
@@ -85,6 +93,14 @@ namespace TTRendering {
 		return true;
 	}
 
+	const unsigned int* SamplerInfo::find(const std::string& key) const {
+		static std::hash<std::string> stringHasher;
+		auto it = nameHashToTextureUnit.find(stringHasher(key));
+		if (it == nameHashToTextureUnit.end())
+			return nullptr;
+		return &it->second;
+	}
+
 	bool UniformInfo::Field::operator==(const UniformInfo::Field& rhs) {
 		return type == rhs.type && offset == rhs.offset && name == rhs.name && arraySize == rhs.arraySize;
 	}
@@ -136,6 +152,9 @@ namespace TTRendering {
 	bool UniformBlockHandle::_setUniform(const char* key, void* src, UniformType srcType, unsigned int count) {
 		if (!_uniformInfo)
 			return false;
+		TT::assert(isLive(), "Setting a uniform of a deleted block.");
+		if (!isLive())
+			return false;
 		const UniformInfo::Field* info = _uniformInfo->find(key);
 		if (!info) return false;
 		if (info->type != srcType)
@@ -143,19 +162,21 @@ namespace TTRendering {
         if(info->arraySize != count)
             return false;
 		memcpy(_resources->uniformBuffer + info->offset, src, sizeOfUniformType(srcType));
+		_resources->markDirty(info->offset, info->offset + sizeOfUniformType(srcType));
 		return true;
 	}
 
 	UniformBlockHandle::UniformBlockHandle(const UniformInfo& uniformInfo, UniformResources* resources) :
-		_uniformInfo(&uniformInfo), _resources(resources) {
+		_uniformInfo(&uniformInfo), _resources(resources), _generation(resources ? resources->generation : 0) {
 	}
 
 	UniformBlockHandle::UniformBlockHandle(UniformResources* resources) :
-		_uniformInfo(nullptr), _resources(resources) {
+		_uniformInfo(nullptr), _resources(resources), _generation(resources ? resources->generation : 0) {
 	}
 
 	size_t UniformBlockHandle::size() const { return _uniformInfo ? _uniformInfo->bufferSize : 0; }
-    unsigned char* UniformBlockHandle::cpuBuffer() const { if (!_resources) return nullptr; return _resources->uniformBuffer; }
+    unsigned char* UniformBlockHandle::cpuBuffer() const { if (!isLive()) return nullptr; return _resources->uniformBuffer; }
+    void UniformBlockHandle::markDirty() const { if (isLive()) _resources->markDirty(0, size()); }
 
 	bool UniformBlockHandle::hasUniformBlock() const { return _uniformInfo != nullptr; }
 
@@ -216,13 +237,13 @@ namespace TTRendering {
 	bool UniformBlockHandle::setBVec4(const char* key, int* value, unsigned int count) { return _setUniform(key, value, UniformType::BVec4, count); }
 
     bool UniformBlockHandle::set(const char* key, const ImageHandle& image) { 
-        if (!_resources) return false;
+        if (!isLive()) return false;
         _resources->images.insert(key, image);
         return true;
     }
 
     bool UniformBlockHandle::set(size_t binding, const BufferHandle& buffer) {
-        if (!_resources) return false;
+        if (!isLive()) return false;
         _resources->ssbos.insert(binding, buffer);
         return true;
     }
@@ -238,10 +259,10 @@ namespace TTRendering {
 	MaterialBlendMode MaterialHandle::blendMode() const { return _blendMode; }
 
     MeshQueue& MaterialQueue::fetch(const MaterialHandle& key, size_t& index) {
-		// Ensure we have a queue with this material instance
-		auto it = materialIdentifierToQueueIndex.find((size_t)&key);
-		if (it == materialIdentifierToQueueIndex.end()) {
-			materialIdentifierToQueueIndex[(size_t)&key] = queues.size();
+		// Ensure we have a queue with this material instance, copies of a handle share the queue
+		auto it = materialToQueueIndex.find(key);
+		if (it == materialToQueueIndex.end()) {
+			materialToQueueIndex[key] = queues.size();
 			keys.push_back(key); // store a copy of all handle info because materials are not managed by the context
             index = queues.size();
 			return queues.emplace_back();
@@ -279,6 +300,359 @@ namespace TTRendering {
         }
 	}
 
+    namespace {
+        template<typename K> size_t internKey(std::unordered_map<K, size_t>& keyToIndex, const K& key, size_t maxBits) {
+            auto it = keyToIndex.find(key);
+            if (it != keyToIndex.end())
+                return it->second;
+            size_t index = keyToIndex.size();
+            TT::assertFatal(index < (1ull << maxBits), "Too many unique states for the draw list sort key.");
+            keyToIndex[key] = index;
+            return index;
+        }
+    }
+
+    size_t MeshQueue::add(const DrawInfo& info, size_t serial) {
+        size_t slot = freeSlots;
+        if (slot == noSlot) {
+            slot = slots.size();
+            slots.emplace_back();
+        } else {
+            freeSlots = slots[slot].dense;
+        }
+        slots[slot] = { (unsigned int)draws.size(), serial };
+        draws.push_back(info);
+        drawSlots.push_back((unsigned int)slot);
+        return slot;
+    }
+
+    void MeshQueue::reserve(size_t count) {
+        draws.reserve(draws.size() + count);
+        drawSlots.reserve(drawSlots.size() + count);
+        slots.reserve(slots.size() + count);
+    }
+
+    bool MeshQueue::remove(size_t slot, size_t serial) {
+        if (slot >= slots.size() || slots[slot].serial != serial || serial == 0)
+            return false;
+        unsigned int dense = slots[slot].dense;
+        draws[dense].meshIdentifier = 0;
+        drawSlots[dense] = noSlot;
+        slots[slot] = { freeSlots, 0 };
+        freeSlots = (unsigned int)slot;
+        // Every compaction halves the draws at most, so removing stays O(1) amortized.
+        if (++numRemoved * 2 > draws.size())
+            compact();
+        return true;
+    }
+
+    void MeshQueue::compact() {
+        size_t dst = 0;
+        for (size_t src = 0; src < draws.size(); ++src) {
+            if (drawSlots[src] == noSlot) continue;
+            draws[dst] = draws[src];
+            drawSlots[dst] = drawSlots[src];
+            slots[drawSlots[dst]].dense = (unsigned int)dst;
+            ++dst;
+        }
+        draws.resize(dst);
+        drawSlots.resize(dst);
+        numRemoved = 0;
+    }
+
+    size_t DrawList::add(size_t meshLayoutHash, const MaterialHandle& material, const DrawInfo& info, size_t serial) {
+        return append(bucketKey(meshLayoutHash, material), info, serial);
+    }
+
+    unsigned long long DrawList::bucketKey(size_t meshLayoutHash, const MaterialHandle& material) {
+        size_t meshLayoutIndex = internKey(meshLayoutHashToIndex, meshLayoutHash, meshLayoutBits);
+        if (meshLayoutIndex == meshLayouts.size()) meshLayouts.push_back(meshLayoutHash);
+        size_t shaderIndex = internKey(shaderIdentifierToIndex, material.shader().identifier(), shaderBits);
+        if (shaderIndex == shaders.size()) shaders.push_back(material.shader());
+        size_t materialIndex = internKey(materialToIndex, material, materialBits);
+        if (materialIndex == materials.size()) materials.push_back(material);
+
+        return ((unsigned long long)meshLayoutIndex << (shaderBits + materialBits + depthBits)) |
+            ((unsigned long long)shaderIndex << (materialBits + depthBits)) |
+            ((unsigned long long)materialIndex << depthBits);
+    }
+
+    size_t DrawList::append(unsigned long long bucketKey, const DrawInfo& info, size_t serial) {
+        TT::assertFatal(next < (1ull << depthBits), "Too many draws for the draw list sort key.");
+        unsigned long long key = bucketKey | (unsigned long long)next++;
+
+        size_t payloadIndex;
+        if (freePayloads.empty()) {
+            payloadIndex = payloads.size();
+            payloads.push_back(info);
+            payloadSerials.push_back(serial);
+        } else {
+            payloadIndex = freePayloads.back();
+            freePayloads.pop_back();
+            payloads[payloadIndex] = info;
+            payloadSerials[payloadIndex] = serial;
+        }
+        keys.push_back(key);
+        payloadIndices.push_back((unsigned int)payloadIndex);
+        sorted = false;
+        return payloadIndex;
+    }
+
+    void DrawList::reserve(size_t count) {
+        payloads.reserve(payloads.size() + count);
+        payloadSerials.reserve(payloadSerials.size() + count);
+        keys.reserve(keys.size() + count);
+        payloadIndices.reserve(payloadIndices.size() + count);
+    }
+
+    bool DrawList::remove(size_t payloadIndex, size_t serial) {
+        if (payloadIndex >= payloads.size() || payloadSerials[payloadIndex] != serial || payloads[payloadIndex].meshIdentifier == 0)
+            return false;
+        payloads[payloadIndex].meshIdentifier = 0;
+        removedPayloads.push_back((unsigned int)payloadIndex);
+        ++numRemoved;
+        sorted = false;
+        return true;
+    }
+
+    void DrawList::sort() {
+        if (sorted) return;
+
+        // Drop removed entries first, so we don't sort what we will not draw.
+        if (numRemoved) {
+            size_t dst = 0;
+            for (size_t src = 0; src < keys.size(); ++src) {
+                if (payloads[payloadIndices[src]].meshIdentifier == 0) continue;
+                keys[dst] = keys[src];
+                payloadIndices[dst] = payloadIndices[src];
+                ++dst;
+            }
+            keys.resize(dst);
+            payloadIndices.resize(dst);
+            numRemoved = 0;
+            freePayloads.insert(freePayloads.end(), removedPayloads.begin(), removedPayloads.end());
+            removedPayloads.clear();
+            pruneStates();
+        }
+
+        // LSD radix sort, 8 bits per pass. All histograms are built in a single read,
+        // and passes where every key has the same digit are skipped.
+        size_t count = keys.size();
+        size_t histograms[8][256] = {};
+        for (unsigned long long key : keys)
+            for (unsigned int pass = 0; pass < 8; ++pass)
+                ++histograms[pass][(key >> (pass * 8)) & 0xFF];
+
+        std::vector<unsigned long long> tmpKeys(count);
+        std::vector<unsigned int> tmpPayloadIndices(count);
+        for (unsigned int pass = 0; pass < 8; ++pass) {
+            size_t* histogram = histograms[pass];
+            if (count == 0 || histogram[(keys[0] >> (pass * 8)) & 0xFF] == count)
+                continue;
+            size_t offset = 0;
+            for (size_t i = 0; i < 256; ++i) {
+                size_t n = histogram[i];
+                histogram[i] = offset;
+                offset += n;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                size_t dst = histogram[(keys[i] >> (pass * 8)) & 0xFF]++;
+                tmpKeys[dst] = keys[i];
+                tmpPayloadIndices[dst] = payloadIndices[i];
+            }
+            keys.swap(tmpKeys);
+            payloadIndices.swap(tmpPayloadIndices);
+        }
+
+        // Renumber the insertion order by rank, so it only counts live draws and never runs out.
+        const unsigned long long orderMask = (1ull << depthBits) - 1;
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = (keys[i] & ~orderMask) | (unsigned long long)i;
+        next = count;
+
+        sorted = true;
+    }
+
+    void DrawList::pruneStates() {
+        // Kept states are renumbered in their old order, so the order of the keys does not change.
+        auto prune = [this](unsigned int shift, unsigned int bits, auto& states, auto& stateToIndex, auto stateKey) {
+            const unsigned long long mask = ((1ull << bits) - 1) << shift;
+            std::vector<size_t> remap(states.size(), 0);
+            for (unsigned long long key : keys)
+                remap[(size_t)((key & mask) >> shift)] = 1;
+            size_t kept = 0;
+            for (size_t i = 0; i < states.size(); ++i) {
+                if (!remap[i]) continue;
+                remap[i] = kept;
+                states[kept++] = states[i];
+            }
+            if (kept == states.size()) return;
+            states.erase(states.begin() + kept, states.end());
+            stateToIndex.clear();
+            for (size_t i = 0; i < kept; ++i)
+                stateToIndex[stateKey(states[i])] = i;
+            for (unsigned long long& key : keys)
+                key = (key & ~mask) | ((unsigned long long)remap[(size_t)((key & mask) >> shift)] << shift);
+        };
+        prune(depthBits, materialBits, materials, materialToIndex, [](const MaterialHandle& material) { return material; });
+        prune(materialBits + depthBits, shaderBits, shaders, shaderIdentifierToIndex, [](const ShaderHandle& shader) { return shader.identifier(); });
+        prune(shaderBits + materialBits + depthBits, meshLayoutBits, meshLayouts, meshLayoutHashToIndex, [](size_t meshLayoutHash) { return meshLayoutHash; });
+    }
+
+    void DrawList::clear() {
+        meshLayoutHashToIndex.clear();
+        meshLayouts.clear();
+        shaderIdentifierToIndex.clear();
+        shaders.clear();
+        materialToIndex.clear();
+        materials.clear();
+        payloads.clear();
+        payloadSerials.clear();
+        removedPayloads.clear();
+        freePayloads.clear();
+        keys.clear();
+        payloadIndices.clear();
+        next = 0;
+        numRemoved = 0;
+        sorted = true;
+    }
+
+    void CommandList::cull(const TT::Mat44& viewProjection) {
+        visibility.assign(draws.size(), 1);
+        if (boundedDraws.empty()) return;
+
+        // Frustum planes are sums and differences of the rows of the column major view projection matrix.
+        // They are not normalized, which does not matter for telling on which side a box is.
+        const float* vp = (const float*)&viewProjection;
+        __m128 planes[6][4];
+        for (int row = 0; row < 3; ++row) {
+            for (int k = 0; k < 4; ++k) {
+                planes[row * 2][k] = _mm_set1_ps(vp[k * 4 + 3] + vp[k * 4 + row]);
+                planes[row * 2 + 1][k] = _mm_set1_ps(vp[k * 4 + 3] - vp[k * 4 + row]);
+            }
+        }
+
+        static const TT::Mat44 identity = TT::MAT44_IDENTITY;
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        const __m128 zero = _mm_setzero_ps();
+        for (size_t first = 0; first < boundedDraws.size(); first += 4) {
+            // Gather four boxes as structure of arrays, the last group repeats its last box.
+            const float* model[4];
+            const Bounds* box[4];
+            for (size_t lane = 0; lane < 4; ++lane) {
+                size_t i = std::min(first + lane, boundedDraws.size() - 1);
+                const PushConstants* pushConstants = draws[boundedDraws[i]].pushConstants;
+                model[lane] = (const float*)(pushConstants ? &pushConstants->modelMatrix : &identity);
+                box[lane] = &bounds[i];
+            }
+
+            __m128 localCenter[3], localExtent[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 min = _mm_setr_ps(box[0]->min[axis], box[1]->min[axis], box[2]->min[axis], box[3]->min[axis]);
+                __m128 max = _mm_setr_ps(box[0]->max[axis], box[1]->max[axis], box[2]->max[axis], box[3]->max[axis]);
+                localCenter[axis] = _mm_mul_ps(_mm_add_ps(min, max), half);
+                localExtent[axis] = _mm_mul_ps(_mm_sub_ps(max, min), half);
+            }
+
+            // World space box that contains the transformed box: the center is transformed,
+            // the extent by the absolute values of the upper 3x3 of the matrix.
+            __m128 center[3], extent[3];
+            for (int i = 0; i < 3; ++i) {
+                center[i] = _mm_setr_ps(model[0][12 + i], model[1][12 + i], model[2][12 + i], model[3][12 + i]);
+                extent[i] = zero;
+                for (int j = 0; j < 3; ++j) {
+                    __m128 m = _mm_setr_ps(model[0][j * 4 + i], model[1][j * 4 + i], model[2][j * 4 + i], model[3][j * 4 + i]);
+                    center[i] = _mm_add_ps(center[i], _mm_mul_ps(m, localCenter[j]));
+                    extent[i] = _mm_add_ps(extent[i], _mm_mul_ps(_mm_andnot_ps(signMask, m), localExtent[j]));
+                }
+            }
+
+            // A box is outside if it is entirely behind any plane.
+            __m128 outside = zero;
+            for (const auto& plane : planes) {
+                __m128 distance = plane[3];
+                __m128 radius = zero;
+                for (int i = 0; i < 3; ++i) {
+                    distance = _mm_add_ps(distance, _mm_mul_ps(plane[i], center[i]));
+                    radius = _mm_add_ps(radius, _mm_mul_ps(_mm_andnot_ps(signMask, plane[i]), extent[i]));
+                }
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+            }
+
+            int outsideBits = _mm_movemask_ps(outside);
+            for (size_t lane = 0; lane < 4 && first + lane < boundedDraws.size(); ++lane)
+                visibility[boundedDraws[first + lane]] = ((outsideBits >> lane) & 1) == 0;
+        }
+    }
+
+    float DepthReference::depth(const PushConstants* pushConstants) const {
+        if (!pushConstants) return 0.0f;
+        const float* m = (const float*)&pushConstants->modelMatrix;
+        if (fromPosition) {
+            float dx = m[12] - position[0];
+            float dy = m[13] - position[1];
+            float dz = m[14] - position[2];
+            return dx * dx + dy * dy + dz * dz;
+        }
+        return plane[0] * m[12] + plane[1] * m[13] + plane[2] * m[14] + plane[3];
+    }
+
+    void CommandList::sortByDepth(const DepthReference& reference) {
+        depths.resize(draws.size());
+        for (size_t i = 0; i < draws.size(); ++i)
+            depths[i] = reference.depth(draws[i].pushConstants);
+
+        sortedDraws.resize(draws.size());
+        for (size_t i = 0; i < draws.size(); ++i)
+            sortedDraws[i] = i;
+        for (const Command& command : commands) {
+            if (command.op != Op::SortedDraws) continue;
+            auto begin = sortedDraws.begin() + command.argument;
+            std::sort(begin, begin + command.count, [&](size_t a, size_t b) { return depths[a] < depths[b]; });
+        }
+
+        // Stable, so blended draws at the same depth keep their queue order.
+        blendedOrder.resize(blendedDraws.size());
+        for (size_t i = 0; i < blendedDraws.size(); ++i)
+            blendedOrder[i] = i;
+        std::stable_sort(blendedOrder.begin(), blendedOrder.end(), [&](size_t a, size_t b) { return depths[blendedDraws[a].draw] > depths[blendedDraws[b].draw]; });
+    }
+
+    void DrawBuckets::add(size_t meshLayoutHash, const MaterialHandle& material, const DrawInfo& info) {
+        // Consecutive draws mostly share a bucket, so check the last one before hashing.
+        if (previousBucket == (size_t)-1 || buckets[previousBucket].meshLayoutHash != meshLayoutHash || buckets[previousBucket].material != material) {
+            std::pair<size_t, MaterialHandle> key(meshLayoutHash, material);
+            auto it = keyToBucket.find(key);
+            if (it == keyToBucket.end()) {
+                it = keyToBucket.emplace(key, buckets.size()).first;
+                buckets.push_back({ meshLayoutHash, material, 0 });
+            }
+            previousBucket = it->second;
+        }
+        ++buckets[previousBucket].count;
+        draws.push_back(info);
+        drawBuckets.push_back((unsigned int)previousBucket);
+    }
+
+    void DrawBuckets::reserve(size_t count) {
+        draws.reserve(draws.size() + count);
+        drawBuckets.reserve(drawBuckets.size() + count);
+    }
+
+    void DrawBuckets::clear() {
+        buckets.clear();
+        draws.clear();
+        drawBuckets.clear();
+        keyToBucket.clear();
+        previousBucket = (size_t)-1;
+    }
+
+    size_t DrawRecorder::addToDrawQueue(const MeshHandle& mesh, const MaterialHandle& material, const PushConstants* pushConstants, size_t instanceCount) {
+        _draws.add(mesh._meshLayoutHash, material, { mesh.identifier(), instanceCount, pushConstants });
+        return _draws.draws.size() - 1;
+    }
+
 	void RenderPass::setPassUniforms(UniformBlockHandle handle) {
 		passUniforms = handle;
 		modified = true;
@@ -300,32 +674,185 @@ namespace TTRendering {
 	}
 
     RenderEntry RenderPass::addToDrawQueue(const MeshHandle& mesh, const MaterialHandle& material, const PushConstants* pushConstants, size_t instanceCount) {
+        return addDraw(mesh._meshLayoutHash, material, { mesh.identifier(), instanceCount, pushConstants });
+    }
+
+    void RenderPass::addToDrawQueue(std::span<const DrawRequest> draws, RenderEntry* entries) {
+        DrawBuckets buckets;
+        buckets.reserve(draws.size());
+        for (const DrawRequest& draw : draws)
+            buckets.add(draw.mesh->_meshLayoutHash, *draw.material, { draw.mesh->identifier(), draw.instanceCount, draw.pushConstants });
+        addBuckets(buckets, entries);
+    }
+
+    void RenderPass::addBuckets(const DrawBuckets& draws, RenderEntry* entries) {
+        struct Bucket {
+            RenderEntry entry; // queue indices of the bucket, in nested mode
+            unsigned long long key; // draw list key of the bucket, in sorted mode
+        };
+        std::vector<Bucket> buckets(draws.buckets.size());
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            const DrawBuckets::Bucket& source = draws.buckets[i];
+            Bucket& bucket = buckets[i];
+            if (_drawQueueMode == DrawQueueMode::Sorted) {
+                bucket.key = _drawList.bucketKey(source.meshLayoutHash, source.material);
+            } else {
+                _drawQueue
+                    .fetch(source.meshLayoutHash, bucket.entry.meshLayoutQueueIndex)
+                    .fetch(source.material._shader, bucket.entry.shaderQueueIndex)
+                    .fetch(source.material, bucket.entry.materialQueueIndex)
+                    .reserve(source.count);
+            }
+        }
+        if (_drawQueueMode == DrawQueueMode::Sorted)
+            _drawList.reserve(draws.draws.size());
+
+        for (size_t i = 0; i < draws.draws.size(); ++i) {
+            const Bucket& bucket = buckets[draws.drawBuckets[i]];
+            RenderEntry entry = bucket.entry;
+            entry.serial = _nextSerial++;
+            if (_drawQueueMode == DrawQueueMode::Sorted) {
+                entry.meshIndex = _drawList.append(bucket.key, draws.draws[i], entry.serial);
+            } else {
+                entry.meshIndex = _drawQueue.queues[entry.meshLayoutQueueIndex].queues[entry.shaderQueueIndex].queues[entry.materialQueueIndex].add(draws.draws[i], entry.serial);
+            }
+            if (entries)
+                entries[i] = entry;
+        }
+        modified = true;
+    }
+
+    RenderEntry RenderPass::addIndirectToDrawQueue(const MeshHandle& mesh, const MaterialHandle& material, const BufferHandle& indirectCommand, const PushConstants* pushConstants) {
+        DrawInfo info;
+        info.meshIdentifier = mesh.identifier();
+        info.pushConstants = pushConstants;
+        info.indirectBuffer = indirectCommand.identifier();
+        return addDraw(mesh._meshLayoutHash, material, info);
+    }
+
+    RenderEntry RenderPass::addDraw(size_t meshLayoutHash, const MaterialHandle& material, const DrawInfo& info) {
         RenderEntry result;
+        result.serial = _nextSerial++;
+        if (_drawQueueMode == DrawQueueMode::Sorted) {
+            // Only the payload index is needed to find the entry back.
+            result.meshIndex = _drawList.add(meshLayoutHash, material, info, result.serial);
+            modified = true;
+            return result;
+        }
         auto& queue = _drawQueue
-            .fetch(mesh._meshLayoutHash, result.meshLayoutQueueIndex)
+            .fetch(meshLayoutHash, result.meshLayoutQueueIndex)
             .fetch(material._shader, result.shaderQueueIndex)
             .fetch(material, result.materialQueueIndex);
-        result.meshIndex = queue.next++;
-        DrawInfo& e = queue.orderedQueue[result.meshIndex];
-        e.meshIdentifier = mesh.identifier();
-        e.instanceCount = instanceCount;
-        e.pushConstants = pushConstants;
+        result.meshIndex = queue.add(info, result.serial);
         modified = true;
         return result;
     }
 
-    void RenderPass::removeFromDrawQueue(const RenderEntry& entry) {
-        _drawQueue.queues[entry.meshLayoutQueueIndex].queues[entry.shaderQueueIndex].queues[entry.materialQueueIndex].orderedQueue.erase(entry.meshIndex);
+    bool RenderPass::removeFromDrawQueue(const RenderEntry& entry) {
+        if (_drawQueueMode == DrawQueueMode::Sorted) {
+            if (!_drawList.remove(entry.meshIndex, entry.serial))
+                return false;
+            modified = true;
+            return true;
+        }
+        // Indices of an entry from before emptyQueue may point past the queues that exist now.
+        if (entry.meshLayoutQueueIndex >= _drawQueue.queues.size())
+            return false;
+        auto& shaderQueue = _drawQueue.queues[entry.meshLayoutQueueIndex];
+        if (entry.shaderQueueIndex >= shaderQueue.queues.size())
+            return false;
+        auto& materialQueue = shaderQueue.queues[entry.shaderQueueIndex];
+        if (entry.materialQueueIndex >= materialQueue.queues.size())
+            return false;
+        if (!materialQueue.queues[entry.materialQueueIndex].remove(entry.meshIndex, entry.serial))
+            return false;
         modified = true;
+        return true;
     }
 
     void RenderPass::emptyQueue() {
         _drawQueue.meshLayoutHashToQueueIndex.clear();
         _drawQueue.keys.clear();
         _drawQueue.queues.clear();
+        _drawList.clear();
         modified = true;
     }
 
+    void RenderPass::submit(std::vector<DrawRecorder>& recorders, std::vector<RenderEntry>* entries) {
+        size_t total = 0;
+        for (const DrawRecorder& recorder : recorders)
+            total += recorder.size();
+        if (_drawQueueMode == DrawQueueMode::Sorted)
+            _drawList.reserve(total);
+        size_t entryOffset = entries ? entries->size() : 0;
+        if (entries)
+            entries->resize(entryOffset + total);
+        // The recorders did the hashing and bucketing, here every bucket is resolved once and the draws appended.
+        for (DrawRecorder& recorder : recorders) {
+            addBuckets(recorder._draws, entries ? entries->data() + entryOffset : nullptr);
+            entryOffset += recorder.size();
+            recorder.clear();
+        }
+    }
+
+    void RenderPass::setMultiDrawIndirect(bool enabled) {
+        _multiDrawIndirect = enabled;
+        modified = true;
+    }
+
+    void RenderPass::setAutoInstancing(bool enabled) {
+        _autoInstancing = enabled;
+        modified = true;
+    }
+
+    void RenderPass::setFrustumCulling(const TT::Mat44& viewProjection) {
+        _frustumCulling = true;
+        _cullingViewProjection = viewProjection;
+    }
+
+    void RenderPass::clearFrustumCulling() {
+        _frustumCulling = false;
+    }
+
+    void RenderPass::setViewMatrix(const TT::Mat44& view) {
+        // Changing the order of draws is part of replaying, only switching sorting on changes what we compile.
+        if (!_depthSorting) modified = true;
+        _depthSorting = true;
+        // The camera looks down -z, so depth is minus the view space z.
+        const float* v = (const float*)&view;
+        _depthReference.fromPosition = false;
+        for (int i = 0; i < 4; ++i)
+            _depthReference.plane[i] = -v[i * 4 + 2];
+    }
+
+    void RenderPass::setCameraPosition(const TT::Vec3& position) {
+        if (!_depthSorting) modified = true;
+        _depthSorting = true;
+        _depthReference.fromPosition = true;
+        _depthReference.position[0] = position.x;
+        _depthReference.position[1] = position.y;
+        _depthReference.position[2] = position.z;
+    }
+
+    void RenderPass::clearDepthSorting() {
+        if (_depthSorting) modified = true;
+        _depthSorting = false;
+    }
+
+    void RenderPass::setGpuTimer(const std::string& name) {
+        _gpuTimerName = name;
+    }
+
+    void RenderPass::clearGpuTimer() {
+        _gpuTimerName.clear();
+    }
+
+    void RenderPass::setDrawQueueMode(DrawQueueMode mode) {
+        if (_drawQueueMode == mode) return;
+        emptyQueue();
+        _drawQueueMode = mode;
+    }
+
 	namespace {
 		unsigned short hashMeshAttribute(const MeshAttribute& attribute) {
 			return ((unsigned short)attribute.location << 8u) | ((unsigned short)attribute.elementType << 2u) | (unsigned short)attribute.dimensions;
@@ -358,9 +885,10 @@ namespace TTRendering {
 		return registerHandleToPool(handle, pool);
 	}
 
-	const ShaderHandle& RenderingContext::registerShader(size_t hash, const ShaderHandle& handle, const std::unordered_map<int, UniformInfo>& uniformBlocks, const ResourcePoolHandle* pool) {
+	const ShaderHandle& RenderingContext::registerShader(size_t hash, const ShaderHandle& handle, const std::unordered_map<int, UniformInfo>& uniformBlocks, const SamplerInfo& samplers, const ResourcePoolHandle* pool) {
 		shaderPool.insert(hash, handle);
 		shaderUniformInfo[handle.identifier()] = uniformBlocks;
+		shaderSamplerInfo[handle.identifier()] = samplers;
 		return registerHandleToPool(handle, pool);
 	}
 
@@ -369,8 +897,348 @@ namespace TTRendering {
         return registerHandleToPool(handle, pool);
 	}
 
+    unsigned char* FixedBlockPool::allocate() {
+        if (!freeBlocks.empty()) {
+            unsigned char* block = freeBlocks.back();
+            freeBlocks.pop_back();
+            return block;
+        }
+        if (usedInLastSlab == blocksPerSlab) {
+            slabs.push_back(new unsigned char[blocksPerSlab * blockSize]);
+            usedInLastSlab = 0;
+        }
+        return slabs.back() + blockSize * usedInLastSlab++;
+    }
+
+    void RangeAllocator::addFree(size_t offset, size_t size) {
+        freeByOffset[offset] = size;
+        freeBySize.insert({ size, offset });
+    }
+
+    void RangeAllocator::removeFree(std::map<size_t, size_t>::iterator it) {
+        auto range = freeBySize.equal_range(it->second);
+        for (auto bySize = range.first; bySize != range.second; ++bySize) {
+            if (bySize->second == it->first) {
+                freeBySize.erase(bySize);
+                break;
+            }
+        }
+        freeByOffset.erase(it);
+    }
+
+    size_t RangeAllocator::allocate(size_t size, size_t alignment) {
+        if (size == 0)
+            return invalid;
+        // The smallest free ranges that fit come first, padding for the alignment may rule some of them out.
+        for (auto it = freeBySize.lower_bound(size); it != freeBySize.end(); ++it) {
+            size_t freeOffset = it->second;
+            size_t freeSize = it->first;
+            size_t offset = (freeOffset + alignment - 1) / alignment * alignment;
+            if (offset + size > freeOffset + freeSize)
+                continue;
+            removeFree(freeByOffset.find(freeOffset));
+            if (offset > freeOffset)
+                addFree(freeOffset, offset - freeOffset);
+            if (offset + size < freeOffset + freeSize)
+                addFree(offset + size, freeOffset + freeSize - offset - size);
+            _used += size;
+            return offset;
+        }
+        return invalid;
+    }
+
+    void RangeAllocator::free(size_t offset, size_t size) {
+        _used -= size;
+        auto next = freeByOffset.lower_bound(offset);
+        if (next != freeByOffset.end() && next->first == offset + size) {
+            size += next->second;
+            removeFree(next);
+        }
+        auto previous = freeByOffset.lower_bound(offset);
+        if (previous != freeByOffset.begin()) {
+            --previous;
+            if (previous->first + previous->second == offset) {
+                offset = previous->first;
+                size += previous->second;
+                removeFree(previous);
+            }
+        }
+        addFree(offset, size);
+    }
+
+    size_t UniformAllocator::sizeClass(size_t size) {
+        // 16 byte steps keep small blocks tight, larger ones round up to a power of two.
+        if (size <= 256)
+            return (size + 15) & ~(size_t)15;
+        size_t blockSize = 512;
+        while (blockSize < size)
+            blockSize *= 2;
+        return blockSize;
+    }
+
+    UniformResources* UniformAllocator::allocate(size_t shaderIdentifier, size_t bufferSize) {
+        UniformResources* block;
+        if (freeResources.empty()) {
+            resources.emplace_back();
+            block = &resources.back();
+        } else {
+            block = freeResources.back();
+            freeResources.pop_back();
+        }
+        block->live = true;
+        if (bufferSize == 0)
+            return block;
+        if (bufferSize > largeBufferSize) {
+            block->uniformBuffer = new unsigned char[bufferSize];
+            return block;
+        }
+        size_t blockSize = sizeClass(bufferSize);
+        std::unique_ptr<FixedBlockPool>& pool = bufferPools[{ shaderIdentifier, blockSize }];
+        if (!pool)
+            pool = std::make_unique<FixedBlockPool>(blockSize);
+        block->bufferPool = pool.get();
+        block->uniformBuffer = pool->allocate();
+        return block;
+    }
+
+    void UniformAllocator::free(UniformResources* block) {
+        if (block->bufferPool) {
+            block->bufferPool->free(block->uniformBuffer);
+        } else {
+            delete[] block->uniformBuffer;
+        }
+        uint32_t generation = block->generation + 1;
+        *block = UniformResources();
+        block->generation = generation;
+        freeResources.push_back(block);
+    }
+
+    void GpuTiming::addSample(double ms) {
+        window[sampleCount % windowSize] = ms;
+        ++sampleCount;
+        lastMs = ms;
+        size_t count = std::min(sampleCount, windowSize);
+        double sum = 0.0;
+        maxMs = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            sum += window[i];
+            maxMs = std::max(maxMs, window[i]);
+        }
+        averageMs = sum / count;
+    }
+
+    const GpuTiming* RenderingContext::gpuTiming(const std::string& name) const {
+        auto it = timings.find(name);
+        return it != timings.end() ? &it->second : nullptr;
+    }
+
+    const RenderingContext::ImageExtent& RenderingContext::imageExtent(const ImageHandle& image) const {
+        auto it = imageExtents.find(image.identifier());
+        TT::assertFatal(it != imageExtents.end());
+        return it->second;
+    }
+
+    void RenderingContext::imageSize(const ImageHandle& image, unsigned int& width, unsigned int& height) const {
+        const ImageExtent& extent = imageExtent(image);
+        width = extent.width;
+        height = extent.height;
+    }
+
+    void RenderingContext::framebufferSize(const FramebufferHandle& framebuffer, unsigned int& width, unsigned int& height) const {
+        if(framebuffer._depthStencilAttachment != ImageHandle::Null)
+            return imageSize(framebuffer._depthStencilAttachment, width, height);
+        TT::assert(framebuffer._colorAttachments.size() > 0);
+        return imageSize(framebuffer._colorAttachments[0], width, height);
+    }
+
+    void RenderingContext::resetIndirectCommand(const BufferHandle& buffer, const MeshHandle& handle) {
+        // Arena meshes can be moved by compactMeshArena, only the pooled copy knows where they are.
+        const MeshHandle* pooled = meshes.find(handle.identifier());
+        const MeshHandle& mesh = pooled ? *pooled : handle;
+        if (mesh.indexBuffer()) {
+            // count, instanceCount, firstIndex, baseVertex, baseInstance
+            unsigned int command[5] = { (unsigned int)mesh.numElements(), 0, (unsigned int)mesh.firstIndex(), (unsigned int)mesh.baseVertex(), 0 };
+            writeBuffer(buffer, command, sizeof(command));
+        } else {
+            // count, instanceCount, first, baseInstance
+            unsigned int command[4] = { (unsigned int)mesh.numElements(), 0, (unsigned int)mesh.baseVertex(), 0 };
+            writeBuffer(buffer, command, sizeof(command));
+        }
+    }
+
+    RenderingContext::MeshArenaRange RenderingContext::allocateMeshArenaRange(size_t vertexSize, size_t vertexStride, size_t indexSize, size_t indexStride) {
+        auto tryPage = [&](size_t page, MeshArenaRange& range) {
+            RangeAllocator& ranges = meshArenaPages[page].ranges;
+            range = { page, ranges.allocate(vertexSize, vertexStride), vertexSize, vertexStride, 0, indexSize, indexStride };
+            if (range.vertexOffset == RangeAllocator::invalid)
+                return false;
+            if (indexSize == 0)
+                return true;
+            range.indexOffset = ranges.allocate(indexSize, indexStride);
+            if (range.indexOffset != RangeAllocator::invalid)
+                return true;
+            ranges.free(range.vertexOffset, vertexSize);
+            return false;
+        };
+        MeshArenaRange range;
+        for (size_t page = 0; page < meshArenaPages.size(); ++page) {
+            if (meshArenaPages[page].open && tryPage(page, range))
+                return range;
+        }
+        // Meshes larger than a page get a page of their own, with room for the alignment padding.
+        size_t pageSize = std::max(meshArenaPageSize, vertexSize + vertexStride + indexSize + indexStride);
+        BufferHandle buffer = createBuffer(pageSize, nullptr, BufferMode::StaticDraw);
+        meshArenaPages.push_back({ buffer, RangeAllocator(pageSize), {} });
+        TT::assertFatal(tryPage(meshArenaPages.size() - 1, range));
+        return range;
+    }
+
+    const MeshHandle& RenderingContext::meshArenaVertexArray(size_t page, size_t meshLayoutHash) {
+        MeshArenaPage& arenaPage = meshArenaPages[page];
+        auto it = arenaPage.vertexArrays.find(meshLayoutHash);
+        if (it == arenaPage.vertexArrays.end()) {
+            // The page holds the indices as well
+            BufferHandle indexBuffer = arenaPage.buffer;
+            MeshHandle vertexArray = createMesh(0, arenaPage.buffer, meshArenaLayouts.find(meshLayoutHash)->second, &indexBuffer);
+            it = arenaPage.vertexArrays.emplace(meshLayoutHash, vertexArray).first;
+        }
+        return it->second;
+    }
+
+    MeshHandle RenderingContext::createArenaMesh(const void* vertexData, size_t vertexDataSize, const std::vector<MeshAttribute>& attributeLayout, const void* indexData, size_t indexDataSize, IndexType indexType, PrimitiveType primitiveType, const ResourcePoolHandle* pool) {
+        size_t vertexStride = 0;
+        for (const auto& attribute : attributeLayout) vertexStride += attribute.sizeInBytes();
+        size_t indexStride = 0;
+        switch (indexType) {
+        case IndexType::U8: indexStride = 1; break;
+        case IndexType::U16: indexStride = 2; break;
+        case IndexType::U32: indexStride = 4; break;
+        default:
+            TT::assert(indexDataSize == 0);
+            indexDataSize = 0;
+            break;
+        }
+        TT::assert(vertexStride > 0 && vertexDataSize > 0);
+
+        size_t meshLayoutHash = TT::hashCombine(hashMeshLayout(attributeLayout), hashMeshLayout({}));
+        if (!meshArenaLayouts.contains(meshLayoutHash))
+            meshArenaLayouts[meshLayoutHash] = attributeLayout;
+
+        MeshArenaRange range = allocateMeshArenaRange(vertexDataSize, vertexStride, indexDataSize, indexStride);
+        const BufferHandle& buffer = meshArenaPages[range.page].buffer;
+        writeBuffer(buffer, vertexData, vertexDataSize, range.vertexOffset);
+        if (indexDataSize)
+            writeBuffer(buffer, indexData, indexDataSize, range.indexOffset);
+
+        MeshHandle mesh = meshArenaVertexArray(range.page, meshLayoutHash);
+        mesh._identifier = nextArenaMeshIdentifier++;
+        mesh._primitiveType = primitiveType;
+        mesh._baseVertex = range.vertexOffset / vertexStride;
+        if (indexDataSize) {
+            mesh._indexType = indexType;
+            mesh._firstIndex = range.indexOffset / indexStride;
+            mesh._numElements = indexDataSize / indexStride;
+        } else {
+            mesh._indexType = IndexType::None;
+            mesh._indexBuffer = BufferHandle::Null;
+            mesh._numElements = vertexDataSize / vertexStride;
+        }
+        meshArenaRanges[mesh.identifier()] = range;
+        return registerMesh(mesh, pool);
+    }
+
+    bool RenderingContext::releaseArenaMesh(const MeshHandle& mesh) {
+        auto it = meshArenaRanges.find(mesh.identifier());
+        if (it == meshArenaRanges.end())
+            return false;
+        const MeshArenaRange& range = it->second;
+        RangeAllocator& ranges = meshArenaPages[range.page].ranges;
+        ranges.free(range.vertexOffset, range.vertexSize);
+        if (range.indexSize)
+            ranges.free(range.indexOffset, range.indexSize);
+        meshArenaRanges.erase(it);
+        return true;
+    }
+
+    size_t RenderingContext::compactMeshArena(float maxOccupancy) {
+        // Close all sparse pages first, so their meshes do not move from one sparse page into the next.
+        std::vector<size_t> sparsePages;
+        for (size_t page = 0; page < meshArenaPages.size(); ++page) {
+            MeshArenaPage& arenaPage = meshArenaPages[page];
+            if (arenaPage.open && arenaPage.ranges.used() <= maxOccupancy * arenaPage.ranges.capacity()) {
+                arenaPage.open = false;
+                sparsePages.push_back(page);
+            }
+        }
+        size_t released = 0;
+        for (size_t page : sparsePages) {
+            for (auto& [identifier, range] : meshArenaRanges) {
+                if (range.page != page) continue;
+                // May add a page
+                MeshArenaRange moved = allocateMeshArenaRange(range.vertexSize, range.vertexStride, range.indexSize, range.indexStride);
+                const BufferHandle& source = meshArenaPages[page].buffer;
+                const BufferHandle& destination = meshArenaPages[moved.page].buffer;
+                copyBuffer(source, range.vertexOffset, destination, moved.vertexOffset, range.vertexSize);
+                if (range.indexSize)
+                    copyBuffer(source, range.indexOffset, destination, moved.indexOffset, range.indexSize);
+
+                // May register a vertex array in meshes, so look the mesh up afterwards.
+                size_t meshLayoutHash = meshes.find(identifier)->_meshLayoutHash;
+                MeshHandle vertexArray = meshArenaVertexArray(moved.page, meshLayoutHash);
+                MeshHandle* mesh = meshes.find(identifier);
+                TT::assertFatal(mesh != nullptr);
+                mesh->_vertexArray = vertexArray._vertexArray;
+                mesh->_vertexBuffer = vertexArray._vertexBuffer;
+                mesh->_baseVertex = moved.vertexOffset / moved.vertexStride;
+                if (range.indexSize) {
+                    mesh->_indexBuffer = vertexArray._indexBuffer;
+                    mesh->_firstIndex = moved.indexOffset / moved.indexStride;
+                }
+                meshArenaPages[page].ranges.free(range.vertexOffset, range.vertexSize);
+                if (range.indexSize)
+                    meshArenaPages[page].ranges.free(range.indexOffset, range.indexSize);
+                range = moved;
+            }
+
+            // The page objects were registered with the default pool, which must not delete them a second time.
+            MeshArenaPage& emptied = meshArenaPages[page];
+            std::vector<ResourceHandle>& defaultPool = resourcePools[defaultResourcePool];
+            for (const auto& pair : emptied.vertexArrays) {
+                const MeshHandle& vertexArray = pair.second;
+                std::erase_if(defaultPool, [&](const ResourceHandle& entry) { return std::holds_alternative<MeshHandle>(entry) && std::get<MeshHandle>(entry) == vertexArray; });
+                deleteMesh(vertexArray);
+            }
+            std::erase_if(defaultPool, [&](const ResourceHandle& entry) { return std::holds_alternative<BufferHandle>(entry) && std::get<BufferHandle>(entry) == emptied.buffer; });
+            deleteBuffer(emptied.buffer);
+            emptied.vertexArrays.clear();
+            emptied.buffer = BufferHandle::Null;
+            ++released;
+        }
+        // Compiled passes hold on to vertex arrays and offsets.
+        if (released)
+            ++resourceGeneration;
+        return released;
+    }
+
+    void RenderingContext::setMeshBounds(MeshHandle& mesh, const Bounds& bounds) {
+        storeMeshBounds(mesh, bounds);
+        // Compiled passes culled with the old bounds.
+        ++resourceGeneration;
+    }
+
+    void RenderingContext::storeMeshBounds(MeshHandle& mesh, const Bounds& bounds) {
+        mesh._hasBounds = true;
+        mesh._bounds = bounds;
+        // drawPass looks meshes up in the pool, so that copy needs the bounds as well.
+        if (MeshHandle* pooled = meshes.find(mesh.identifier())) {
+            pooled->_hasBounds = true;
+            pooled->_bounds = bounds;
+        }
+    }
+
     void RenderingContext::deregisterMesh(const MeshHandle& handle) {
         meshes.remove(handle);
+        ++resourceGeneration;
     }
     
     void RenderingContext::deregisterShaderStage(const ShaderStageHandle& handle) {
@@ -380,6 +1248,8 @@ namespace TTRendering {
     void RenderingContext::deregisterShader(const ShaderHandle& handle) {
         shaderPool.removeValue(handle);
         shaderUniformInfo.erase(handle.identifier());
+        shaderSamplerInfo.erase(handle.identifier());
+        ++resourceGeneration;
     }
 
     const UniformInfo* RenderingContext::materialUniformInfo(const ShaderHandle& handle) const {
@@ -393,16 +1263,24 @@ namespace TTRendering {
         return uniformInfo;
     }
 
+    const SamplerInfo* RenderingContext::samplerInfo(const ShaderHandle& handle) const {
+        auto it = shaderSamplerInfo.find(handle.identifier());
+        if (it == shaderSamplerInfo.end())
+            return nullptr;
+        return &it->second;
+    }
+
 	MaterialHandle RenderingContext::createMaterial(const ShaderHandle& shader, MaterialBlendMode blendMode, const ResourcePoolHandle* pool) {
 		TT::assert(shaderUniformInfo.contains(shader.identifier()));
 		const std::unordered_map<int, UniformInfo>& info = shaderUniformInfo.find(shader.identifier())->second;
 		auto it = info.find((int)UniformBlockSemantics::Material);
 		if (it != info.end()) {
-            materialResources.push_back(new UniformResources {new unsigned char[it->second.bufferSize], {}, {} });
-            return registerHandleToPool(MaterialHandle(shader, it->second, materialResources.back(), blendMode), pool);
+            UniformResources* resources = uniformAllocator.allocate(shader.identifier(), it->second.bufferSize);
+            // Nothing has been uploaded yet.
+            resources->markDirty(0, it->second.bufferSize);
+            return registerHandleToPool(MaterialHandle(shader, it->second, resources, blendMode), pool);
 		}
-        materialResources.push_back(new UniformResources {nullptr, {}, {} });
-        return registerHandleToPool(MaterialHandle(shader, materialResources.back(), blendMode), pool);
+        return registerHandleToPool(MaterialHandle(shader, uniformAllocator.allocate(shader.identifier(), 0), blendMode), pool);
 	}
 
 	UniformBlockHandle RenderingContext::createUniformBuffer(const ShaderHandle& shader, const UniformBlockSemantics& semantic, const ResourcePoolHandle* pool) {
@@ -411,26 +1289,25 @@ namespace TTRendering {
 		TT::assert(shaderUniformInfo.contains(shader.identifier()));
 		const std::unordered_map<int, UniformInfo>& info = shaderUniformInfo.find(shader.identifier())->second;
 		auto it = info.find((int)semantic);
-		if (it != info.end()) {
-            materialResources.push_back(new UniformResources { new unsigned char[it->second.bufferSize], {}, {} });
-			return registerHandleToPool(UniformBlockHandle (it->second, materialResources.back()));
-		}
-        materialResources.push_back(new UniformResources {nullptr, {}, {} });
-		return registerHandleToPool(UniformBlockHandle(materialResources.back()));
+		if (it != info.end())
+			return registerHandleToPool(UniformBlockHandle (it->second, uniformAllocator.allocate(shader.identifier(), it->second.bufferSize)));
+		return registerHandleToPool(UniformBlockHandle(uniformAllocator.allocate(shader.identifier(), 0)));
 	}
 
     void RenderingContext::deleteMaterial(const MaterialHandle& material) {
-        auto it = std::find(materialResources.begin(), materialResources.end(), material._resources);
         // We must anticipate that an invalidated handle is being supplied.
-        if(it != materialResources.end())
-            materialResources.erase(it);
+        // Slabs are never returned, so a stale handle still points at a block we can look at.
+        if (material.isLive()) {
+            deleteMaterialStorage(material);
+            uniformAllocator.free(material._resources);
+            // Compiled passes bind the material's slice, which the next material may get.
+            ++resourceGeneration;
+        }
     }
 
     void RenderingContext::deleteUniformBuffer(const UniformBlockHandle& uniformBuffer) {
-        auto it = std::find(materialResources.begin(), materialResources.end(), uniformBuffer._resources);
-        // We must anticipate that an invalidated handle is being supplied.
-        if(it != materialResources.end())
-            materialResources.erase(it);
+        if (uniformBuffer.isLive())
+            uniformAllocator.free(uniformBuffer._resources);
     }
 
 	ShaderStageHandle RenderingContext::fetchShaderStage(const char* glslFilePath, const ResourcePoolHandle* pool) {
@@ -440,11 +1317,12 @@ namespace TTRendering {
 	}
 
 	ShaderHandle RenderingContext::fetchShader(const std::vector<ShaderStageHandle>& stages, const ResourcePoolHandle* pool) {
+		TT_PROFILE_SCOPE("fetchShader");
 		size_t hash = hashHandles(stages.data(), stages.size());
 		if (const ShaderHandle* existing = shaderPool.find(hash))
 			return *existing;
 		ShaderHandle shader = createShader(stages);
-		return registerShader(hash, shader, getUniformBlocks(shader, stages), pool);
+		return registerShader(hash, shader, getUniformBlocks(shader, stages), getSamplers(shader), pool);
 	}
 
     ResourcePoolHandle RenderingContext::createResourcePool(const ResourcePoolHandle* pool) {
@@ -453,6 +1331,7 @@ namespace TTRendering {
     }
     
     void RenderingContext::deleteResourcePoolInternal(const ResourcePoolHandle& handle, bool erase) {
+        TT_PROFILE_SCOPE("deleteResourcePool");
         const auto& it = resourcePools.find(handle.identifier());
         TT::assert(it != resourcePools.end()); // if (it == resourcePools.end()) return;
         for(const auto& entry : it->second) {
@@ -498,7 +1377,127 @@ namespace TTRendering {
         deleteResourcePoolInternal(handle, true); 
     }
 
-	ImageHandle RenderingContext::loadImage(const char* filePath, ImageInterpolation interpolation, ImageTiling tiling, const ResourcePoolHandle* pool) {
+    namespace {
+        // Averages 2x2 blocks of an 8 bit image into the rows [rowBegin, rowEnd) of the next mip level.
+        // Sizes round down like GL mip levels, so an odd last column or row is dropped, and a single one is repeated.
+        void downsampleRows(const unsigned char* source, unsigned int width, unsigned int height, unsigned int channels, unsigned char* target, unsigned int rowBegin, unsigned int rowEnd) {
+            unsigned int targetWidth = std::max(1u, width / 2);
+            for (unsigned int y = rowBegin; y < rowEnd; ++y) {
+                const unsigned char* row0 = source + (size_t)std::min(y * 2, height - 1) * width * channels;
+                const unsigned char* row1 = source + (size_t)std::min(y * 2 + 1, height - 1) * width * channels;
+                unsigned char* out = target + (size_t)y * targetWidth * channels;
+                for (unsigned int x = 0; x < targetWidth; ++x) {
+                    size_t x0 = (size_t)std::min(x * 2, width - 1) * channels;
+                    size_t x1 = (size_t)std::min(x * 2 + 1, width - 1) * channels;
+                    for (unsigned int c = 0; c < channels; ++c)
+                        out[x * channels + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+                }
+            }
+        }
+
+        // A few threads started on first use and kept until exit, so loading images does not spawn threads per level.
+        // The calling thread works along, and one run at a time has the workers.
+        class MipWorkers {
+            std::vector<std::thread> threads;
+            std::mutex runMutex;
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::condition_variable done;
+            const std::function<void(unsigned int)>* job = nullptr;
+            unsigned int nextBlock = 0;
+            unsigned int blockCount = 0;
+            unsigned int pending = 0;
+            bool quit = false;
+
+            // Takes blocks of the current run until there are none left, the lock is held between blocks.
+            void takeBlocks(std::unique_lock<std::mutex>& lock) {
+                while (nextBlock < blockCount) {
+                    unsigned int block = nextBlock++;
+                    lock.unlock();
+                    (*job)(block);
+                    lock.lock();
+                    if (--pending == 0)
+                        done.notify_all();
+                }
+            }
+
+            void work() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    wake.wait(lock, [this] { return quit || nextBlock < blockCount; });
+                    if (quit) return;
+                    takeBlocks(lock);
+                }
+            }
+
+        public:
+            static constexpr unsigned int maxThreads = 8;
+
+            MipWorkers() {
+                unsigned int count = std::min(std::max(1u, std::thread::hardware_concurrency()) - 1, maxThreads);
+                for (unsigned int i = 0; i < count; ++i)
+                    threads.emplace_back(&MipWorkers::work, this);
+            }
+            ~MipWorkers() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    quit = true;
+                }
+                wake.notify_all();
+                for (std::thread& thread : threads)
+                    thread.join();
+            }
+
+            // Including the calling thread.
+            unsigned int size() const { return (unsigned int)threads.size() + 1; }
+
+            // Calls blockJob for every block in [0, blocks) and returns once all of them are done.
+            void run(unsigned int blocks, const std::function<void(unsigned int)>& blockJob) {
+                std::lock_guard<std::mutex> runLock(runMutex);
+                std::unique_lock<std::mutex> lock(mutex);
+                job = &blockJob;
+                nextBlock = 0;
+                blockCount = pending = blocks;
+                wake.notify_all();
+                takeBlocks(lock);
+                done.wait(lock, [this] { return pending == 0; });
+                job = nullptr;
+            }
+        };
+
+        // Computes the next mip level. Large levels are split by rows over the mip workers, small ones are done inline.
+        std::vector<unsigned char> downsample(const unsigned char* source, unsigned int width, unsigned int height, unsigned int channels) {
+            TT_PROFILE_SCOPE("downsample");
+            unsigned int targetWidth = std::max(1u, width / 2);
+            unsigned int targetHeight = std::max(1u, height / 2);
+            std::vector<unsigned char> target((size_t)targetWidth * targetHeight * channels);
+            const size_t minTexelsPerBlock = 64 * 1024;
+            size_t blocks = std::min((size_t)targetHeight, (size_t)targetWidth * targetHeight / minTexelsPerBlock);
+            if (blocks <= 1) {
+                downsampleRows(source, width, height, channels, target.data(), 0, targetHeight);
+                return target;
+            }
+            static MipWorkers workers;
+            blocks = std::min(blocks, (size_t)workers.size());
+            unsigned int rowsPerBlock = (unsigned int)((targetHeight + blocks - 1) / blocks);
+            unsigned int blockCount = (targetHeight + rowsPerBlock - 1) / rowsPerBlock;
+            workers.run(blockCount, [&](unsigned int block) {
+                unsigned int rowBegin = block * rowsPerBlock;
+                downsampleRows(source, width, height, channels, target.data(), rowBegin, std::min(rowBegin + rowsPerBlock, targetHeight));
+            });
+            return target;
+        }
+    }
+
+    unsigned int RenderingContext::mipLevelCount(unsigned int width, unsigned int height) {
+        unsigned int levels = 1;
+        for (unsigned int size = std::max(width, height); size > 1; size /= 2)
+            ++levels;
+        return levels;
+    }
+
+	ImageHandle RenderingContext::loadImage(const char* filePath, ImageInterpolation interpolation, ImageTiling tiling, const ResourcePoolHandle* pool, MipGeneration mips) {
+		TT_PROFILE_SCOPE("loadImage");
 		int width, height, channels;
 		unsigned char* data = stbi_load(filePath, &width, &height, &channels, 0);
 		ImageFormat format;
@@ -509,12 +1508,27 @@ namespace TTRendering {
 		case 4: format = ImageFormat::RGBA8; break;
         default: TT::error("Invalid image: %s", filePath); return ImageHandle::Null;
 		}
-		ImageHandle r = createImage(width, height, format, interpolation, tiling, data, pool);
+		bool cpuMips = mips == MipGeneration::CPU && hasMipChain(interpolation);
+		ImageHandle r = createImage(width, height, format, interpolation, tiling, cpuMips ? nullptr : data, pool);
+		if (cpuMips) {
+			writeImageLevel(r, 0, data);
+			std::vector<unsigned char> level;
+			const unsigned char* previous = data;
+			unsigned int levelWidth = width, levelHeight = height;
+			for (unsigned int i = 1; i < imageMipLevels(r); ++i) {
+				level = downsample(previous, levelWidth, levelHeight, channels);
+				levelWidth = std::max(1u, levelWidth / 2);
+				levelHeight = std::max(1u, levelHeight / 2);
+				writeImageLevel(r, i, level.data());
+				previous = level.data();
+			}
+		}
 		stbi_image_free(data);
 		return { r };
 	}
 
     MeshFileInfo RenderingContext::loadMesh(const char* fbxFilePath, const ResourcePoolHandle* pool) {
+        TT_PROFILE_SCOPE("loadMesh");
         TT::FbxExtractor scene(fbxFilePath);
 
         // Bidirectional LUT to go from mesh handle to material and back
@@ -535,8 +1549,15 @@ namespace TTRendering {
 
             std::vector<MeshAttribute> layout;
             unsigned int vertexStride = 0;
+            // The position is the first vertex semantic, so it lands at location 0. We need 3 floats for bounds.
+            static const unsigned char positionLocation = 0;
+            unsigned int positionOffset = (unsigned int)-1;
             for(unsigned int i = 0; i < mesh.attributeCount;++i) {
                 if (mesh.attributeLayout[i].numElements == NumElements::Invalid) continue;
+                if ((unsigned char)mesh.attributeLayout[i].semantic == positionLocation &&
+                    mesh.attributeLayout[i].elementType == ElementType::Float &&
+                    (unsigned char)mesh.attributeLayout[i].numElements >= 3)
+                    positionOffset = vertexStride;
                 MeshAttribute entry;
                 entry.location = (unsigned char)mesh.attributeLayout[i].semantic;
                 entry.dimensions = (MeshAttribute::Dimensions)((unsigned char)mesh.attributeLayout[i].numElements - 1);
@@ -559,6 +1580,13 @@ namespace TTRendering {
                 continue;
             }
             
+            IndexType indexType = IndexType::None;
+            switch (mesh.indexElementSizeInBytes) {
+            case 1: indexType = IndexType::U8; break;
+            case 2: indexType = IndexType::U16; break;
+            case 4: indexType = IndexType::U32; break;
+            }
+
             std::vector<std::pair<size_t, size_t>> uploadedMeshIndices;
             for(unsigned int i = 0; i < mesh.meshCount; ++i) {
                 const auto& subMesh = mesh.meshes[i];
@@ -566,13 +1594,28 @@ namespace TTRendering {
                     TT::assert(false);
                     continue;
                 }
-                auto vbo = createBuffer(subMesh.vertexDataSizeInBytes, subMesh.vertexDataBlob, BufferMode::StaticDraw,  pool);
                 MeshHandle gpuMesh = MeshHandle::Null;
                 if(subMesh.indexDataSizeInBytes) {
-                    auto ibo = createBuffer(subMesh.indexDataSizeInBytes, subMesh.indexDataBlob, BufferMode::StaticDraw, pool);
-                    gpuMesh = createMesh(subMesh.indexDataSizeInBytes / mesh.indexElementSizeInBytes, vbo, layout, &ibo, PrimitiveType::Triangle, 0, nullptr, {}, pool);
+                    gpuMesh = createArenaMesh(subMesh.vertexDataBlob, subMesh.vertexDataSizeInBytes, layout, subMesh.indexDataBlob, subMesh.indexDataSizeInBytes, indexType, PrimitiveType::Triangle, pool);
                 } else {
-                    gpuMesh = createMesh(subMesh.vertexDataSizeInBytes / vertexStride, vbo, layout, nullptr, PrimitiveType::Triangle, 0, nullptr, {}, pool);
+                    gpuMesh = createArenaMesh(subMesh.vertexDataBlob, subMesh.vertexDataSizeInBytes, layout, nullptr, 0, IndexType::None, PrimitiveType::Triangle, pool);
+                }
+
+                size_t numVertices = subMesh.vertexDataSizeInBytes / vertexStride;
+                if (positionOffset != (unsigned int)-1 && numVertices > 0) {
+                    Bounds bounds;
+                    const unsigned char* vertex = (const unsigned char*)subMesh.vertexDataBlob + positionOffset;
+                    memcpy(bounds.min, vertex, sizeof(bounds.min));
+                    memcpy(bounds.max, vertex, sizeof(bounds.max));
+                    for (size_t v = 1; v < numVertices; ++v) {
+                        float position[3];
+                        memcpy(position, vertex + v * vertexStride, sizeof(position));
+                        for (int axis = 0; axis < 3; ++axis) {
+                            bounds.min[axis] = std::min(bounds.min[axis], position[axis]);
+                            bounds.max[axis] = std::max(bounds.max[axis], position[axis]);
+                        }
+                    }
+                    storeMeshBounds(gpuMesh, bounds);
                 }
 
                 std::string materialName(mesh.materialNames[subMesh.materialId].buffer, mesh.materialNames[subMesh.materialId].length);
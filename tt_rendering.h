@@ -9,43 +9,136 @@
 #include <string>
 #include <algorithm>
 #include <variant>
+#include <span>
+#include <cstdint>
+#include <deque>
+#include <memory>
 
 #ifndef BEFRIEND_CONTEXTS
 #define BEFRIEND_CONTEXTS friend class RenderingContext; friend class OpenGLContext; friend class VkContext;
 #endif
 
+// Per frame statistics counters, compiled into debug builds only. Define TT_RENDERING_STATS to keep them in release.
+#if !defined(TT_RENDERING_STATS) && !defined(NDEBUG)
+#define TT_RENDERING_STATS
+#endif
+
+#ifdef TT_RENDERING_STATS
+#define TT_RENDERING_STAT(statement) statement
+#else
+#define TT_RENDERING_STAT(statement)
+#endif
+
 namespace TTRendering {
-	// The reason these exist is because internally std::map generates std::pair
-	// which in turn fails to copy or default construct or whatever. std::vector works fine.
-    // TODO: Since handles are now nullable we can make them default construct to null and then it should work (?)
+	// Values are kept packed for iteration, removing one moves the last value into its place.
+	// Keys go through a slot that remembers where its value lives, so they survive such moves, and a generation
+	// per slot makes keys of removed values stale instead of silently pointing at whatever reused the slot.
+	// Insert, remove and find are O(1) and freed slots are reused, so memory is bounded by the peak size.
+	template<typename T>
+	class SlotMap {
+	public:
+		struct Key {
+			uint32_t slot = 0xFFFFFFFF;
+			uint32_t generation = 0;
+		};
+
+	private:
+		struct Slot {
+			uint32_t dense;
+			uint32_t generation;
+		};
+
+		std::vector<T> values;
+		std::vector<uint32_t> valueSlots; // slot of every value
+		std::vector<Slot> slots;
+		std::vector<uint32_t> freeSlots;
+
+	public:
+		Key insert(const T& value) {
+			uint32_t slot;
+			if (freeSlots.empty()) {
+				slot = (uint32_t)slots.size();
+				slots.push_back({ 0, 0 });
+			} else {
+				slot = freeSlots.back();
+				freeSlots.pop_back();
+			}
+			slots[slot].dense = (uint32_t)values.size();
+			values.push_back(value);
+			valueSlots.push_back(slot);
+			return { slot, slots[slot].generation };
+		}
+
+		bool contains(Key key) const { return key.slot < slots.size() && slots[key.slot].generation == key.generation; }
+
+		// Returns false if the key is stale.
+		bool remove(Key key) {
+			if (!contains(key))
+				return false;
+			uint32_t dense = slots[key.slot].dense;
+			uint32_t last = (uint32_t)values.size() - 1;
+			if (dense != last) {
+				values[dense] = std::move(values[last]);
+				valueSlots[dense] = valueSlots[last];
+				slots[valueSlots[dense]].dense = dense;
+			}
+			values.pop_back();
+			valueSlots.pop_back();
+			++slots[key.slot].generation;
+			freeSlots.push_back(key.slot);
+			return true;
+		}
+
+		const T* find(Key key) const { return contains(key) ? &values[slots[key.slot].dense] : nullptr; }
+		T* find(Key key) { return contains(key) ? &values[slots[key.slot].dense] : nullptr; }
+
+		size_t size() const { return values.size(); }
+
+		auto begin() const { return values.begin(); }
+		auto end() const { return values.end(); }
+
+		auto begin() { return values.begin(); }
+		auto end() { return values.end(); }
+	};
+
+	// Handles by their identifier. Iteration only visits live handles.
 	template<typename T>
 	class HandlePool {
-		std::unordered_map<size_t, size_t> identifierToIndex;
-		std::vector<T> handles;
+		std::unordered_map<size_t, typename SlotMap<T>::Key> identifierToKey;
+		SlotMap<T> handles;
 
 	public:
 		void insert(const T& handle) {
 			size_t identifier = handle.identifier();
-			auto it = identifierToIndex.find(identifier);
-			if (it != identifierToIndex.end())
+			if (identifierToKey.contains(identifier))
 				return;
-			identifierToIndex[identifier] = handles.size();
-			handles.push_back(handle);
+			identifierToKey[identifier] = handles.insert(handle);
 		}
 
         void remove(const T& handle) {
-            // Note: we do not remove from handles[] here because
-            // that would invalidate all indices in identifierToIndex.
-            identifierToIndex.erase(handle.identifier());
+            auto it = identifierToKey.find(handle.identifier());
+            if (it == identifierToKey.end())
+                return;
+            handles.remove(it->second);
+            identifierToKey.erase(it);
         }
 
 		const T* find(size_t identifier) const {
-			auto it = identifierToIndex.find(identifier);
-			if (it != identifierToIndex.end())
-				return &handles[it->second];
+			auto it = identifierToKey.find(identifier);
+			if (it != identifierToKey.end())
+				return handles.find(it->second);
+			return nullptr;
+		}
+
+		T* find(size_t identifier) {
+			auto it = identifierToKey.find(identifier);
+			if (it != identifierToKey.end())
+				return handles.find(it->second);
 			return nullptr;
 		}
 
+        size_t size() const { return handles.size(); }
+
         auto begin() const { return handles.begin(); }
         auto end() const { return handles.end(); }
 
@@ -53,55 +146,68 @@ namespace TTRendering {
         auto end() { return handles.end(); }
 	};
 
+	// Handles by an arbitrary key. Iteration visits live (key, handle) pairs.
 	template<typename K, typename T>
 	class HandleDict {
-		std::unordered_map<K, size_t> keyToIndex;
-		std::vector<T> handles;
+		typedef std::pair<K, T> Entry;
+		typedef typename SlotMap<Entry>::Key SlotKey;
+
+		std::unordered_map<K, SlotKey> keyToSlot;
+		std::unordered_multimap<size_t, SlotKey> identifierToSlot; // reverse index for removeValue, a handle may be stored under several keys
+		SlotMap<Entry> entries;
 
 	public:
 		void insert(const K& key, const T& handle) {
-			auto it = keyToIndex.find(key);
-			if (it != keyToIndex.end())
+			if (keyToSlot.contains(key))
 				return;
-			keyToIndex[key] = handles.size();
-			handles.push_back(handle);
+			SlotKey slot = entries.insert({ key, handle });
+			keyToSlot[key] = slot;
+			identifierToSlot.insert({ handle.identifier(), slot });
 		}
         
         void remove(const K& key) {
-            // Note: we do not remove from handles[] here because
-            // that would invalidate all indices in keyToIndex.
-            keyToIndex.erase(key);
+            auto it = keyToSlot.find(key);
+            if (it == keyToSlot.end())
+                return;
+            SlotKey slot = it->second;
+            auto range = identifierToSlot.equal_range(entries.find(slot)->second.identifier());
+            for (auto reverse = range.first; reverse != range.second; ++reverse) {
+                if (reverse->second.slot == slot.slot) {
+                    identifierToSlot.erase(reverse);
+                    break;
+                }
+            }
+            entries.remove(slot);
+            keyToSlot.erase(it);
         }
 
+        // Removes one of the keys the handle is stored under.
         void removeValue(const T& handle) {
-            // TODO: This is slow and bad.
-            const auto& it_ = std::find(handles.begin(), handles.end(), handle);
+            auto it = identifierToSlot.find(handle.identifier());
             // Like remove, this fails silently in the event the handle was invalid already.
-            if (it_ == handles.end()) return;
-            size_t handleIndex = it_ - handles.begin();
-            const auto& it = std::find_if(keyToIndex.begin(), keyToIndex.end(), [&handleIndex](auto&& pair) { return pair.second == handleIndex; });
-            if (it == keyToIndex.end()) return;
-            remove(it->first);
+            if (it == identifierToSlot.end()) return;
+            K key = entries.find(it->second)->first; // remove invalidates it
+            remove(key);
         }
 
         const T* find(const K& key) const {
-            auto it = keyToIndex.find(key);
-            if (it == keyToIndex.end())
+            auto it = keyToSlot.find(key);
+            if (it == keyToSlot.end())
                 return nullptr;
-            return &handles[it->second];
+            return &entries.find(it->second)->second;
         }
 
         T* find(const K& key) {
-            auto it = keyToIndex.find(key);
-            if (it == keyToIndex.end())
+            auto it = keyToSlot.find(key);
+            if (it == keyToSlot.end())
                 return nullptr;
-            return &handles[it->second];
+            return &entries.find(it->second)->second;
         }
 
-		auto begin() const { return keyToIndex.begin(); }
-		auto end() const { return keyToIndex.end(); }
-		const T& handle(size_t index) const { return handles[index]; }
-		T& handle(size_t index) { return handles[index]; }
+        size_t size() const { return entries.size(); }
+
+		auto begin() const { return entries.begin(); }
+		auto end() const { return entries.end(); }
 
 		const T& operator[](const K& key) const {
 			return *find(key);
@@ -190,19 +296,31 @@ namespace TTRendering {
 		None, U8, U16, U32
 	};
     
+    // Axis aligned box in the local space of a mesh.
+    struct Bounds {
+        float min[3];
+        float max[3];
+    };
+
 	class MeshHandle final : public HandleBase {
 		BEFRIEND_CONTEXTS;
 
 		friend class RenderPass;
+		friend class DrawRecorder;
 
 		size_t _meshLayoutHash;
+		size_t _vertexArray; // what the backend binds to draw, shared by the arena meshes of a page and layout
 		BufferHandle _vertexBuffer;
+		size_t _baseVertex = 0; // in vertices, into _vertexBuffer
+		size_t _firstIndex = 0; // in indices, into _indexBuffer
 		size_t _numElements; // num indices if ibo != nullptr, else num vertices
 		PrimitiveType _primitiveType;
 		IndexType _indexType;
         BufferHandle _indexBuffer = BufferHandle::Null;
         size_t _numInstances;
 		BufferHandle _instanceBuffer = BufferHandle::Null;
+        bool _hasBounds = false;
+        Bounds _bounds = {};
 
 		MeshHandle(
             size_t identifier,
@@ -220,6 +338,10 @@ namespace TTRendering {
 		const BufferHandle* indexBuffer() const;
 		PrimitiveType primitiveType() const;
 		IndexType indexType() const;
+        size_t baseVertex() const { return _baseVertex; }
+        size_t firstIndex() const { return _firstIndex; }
+        // Null if the mesh has no bounds, it is never culled in that case.
+        const Bounds* bounds() const { return _hasBounds ? &_bounds : nullptr; }
 
         static const MeshHandle Null;
         operator bool() const { return *this != Null; }
@@ -233,9 +355,18 @@ namespace TTRendering {
 		R8, RG8, RGB8, RGBA8,
 	};
 
+	// Trilinear and Anisotropic images get immutable storage with a full mip chain, so they cannot be resized.
 	enum class ImageInterpolation {
 		Linear,
 		Nearest,
+		Trilinear,
+		Anisotropic, // trilinear with the highest anisotropy the driver supports
+	};
+
+	// Where loadImage computes the mip chain of images that have one.
+	enum class MipGeneration {
+		GPU,
+		CPU, // box filter on worker threads, keeps the GPU free when streaming in many images
 	};
 
 	enum class ImageTiling {
@@ -343,11 +474,110 @@ namespace TTRendering {
 		const Field* find(const char* key) const;
 	};
 
+    // Texture units that were assigned to the sampler uniforms of a shader when it was linked.
+    // Elements of sampler arrays get consecutive units and can be found as "name[i]", "name" is element 0.
+	struct SamplerInfo {
+		std::unordered_map<size_t, unsigned int> nameHashToTextureUnit;
+		unsigned int textureUnitCount = 0;
+
+		const unsigned int* find(const std::string& key) const;
+	};
+
     namespace {
+        // Hands out blocks of a single size carved from slabs, freed blocks are handed out again first.
+        class FixedBlockPool {
+            size_t blockSize;
+            size_t blocksPerSlab;
+            std::vector<unsigned char*> slabs;
+            std::vector<unsigned char*> freeBlocks;
+            size_t usedInLastSlab = 0;
+
+            FixedBlockPool(const FixedBlockPool&) = delete;
+            FixedBlockPool& operator=(const FixedBlockPool&) = delete;
+
+        public:
+            static const size_t slabSize = 64 * 1024;
+
+            FixedBlockPool(size_t blockSize) : blockSize(blockSize), blocksPerSlab(std::max((size_t)1, slabSize / blockSize)), usedInLastSlab(blocksPerSlab) {}
+            ~FixedBlockPool() {
+                for (unsigned char* slab : slabs)
+                    delete[] slab;
+            }
+
+            unsigned char* allocate();
+            void free(unsigned char* block) { freeBlocks.push_back(block); }
+        };
+
         struct UniformResources {
-            unsigned char* uniformBuffer;
+            unsigned char* uniformBuffer = nullptr;
             HandleDict<std::string, ImageHandle> images;
             HandleDict<size_t, BufferHandle> ssbos;
+            // Byte range of uniformBuffer that changed since it was last uploaded, empty when dirtyBegin == dirtyEnd.
+            size_t dirtyBegin = 0;
+            size_t dirtyEnd = 0;
+            // Offset of the GPU copy of uniformBuffer, owned by the context.
+            size_t gpuOffset = (size_t)-1;
+            // Bumped when the block is freed, so handles can tell their block has been reused.
+            uint32_t generation = 0;
+            bool live = false;
+            FixedBlockPool* bufferPool = nullptr; // where uniformBuffer came from, null if it got its own allocation
+
+            void markDirty(size_t begin, size_t end) {
+                if (dirtyBegin == dirtyEnd) {
+                    dirtyBegin = begin;
+                    dirtyEnd = end;
+                    return;
+                }
+                dirtyBegin = std::min(dirtyBegin, begin);
+                dirtyEnd = std::max(dirtyEnd, end);
+            }
+        };
+
+        // Best fit offset allocator over a fixed range, e.g. a buffer. Freed ranges merge with free neighbours.
+        class RangeAllocator {
+            std::map<size_t, size_t> freeByOffset; // offset to size
+            std::multimap<size_t, size_t> freeBySize; // size to offset
+            size_t _capacity;
+            size_t _used = 0;
+
+            void addFree(size_t offset, size_t size);
+            void removeFree(std::map<size_t, size_t>::iterator it);
+
+        public:
+            static const size_t invalid = (size_t)-1;
+
+            RangeAllocator(size_t capacity) : _capacity(capacity) { addFree(0, capacity); }
+
+            // Returns invalid if no free range fits. The alignment does not have to be a power of two.
+            size_t allocate(size_t size, size_t alignment);
+            void free(size_t offset, size_t size);
+
+            size_t capacity() const { return _capacity; }
+            size_t used() const { return _used; }
+        };
+
+        // Owns the UniformResources of all materials and uniform blocks, and their CPU uniform buffers.
+        // Buffers come from slabs per shader and size class, so the blocks of a shader's materials sit next to each other.
+        // Blocks remember the pool they came from, so freeing is O(1).
+        class UniformAllocator {
+            std::deque<UniformResources> resources; // a deque, so handing out more never moves the ones in use
+            std::vector<UniformResources*> freeResources;
+            std::map<std::pair<size_t, size_t>, std::unique_ptr<FixedBlockPool>> bufferPools; // by shader and size class
+
+        public:
+            static const size_t largeBufferSize = FixedBlockPool::slabSize / 4; // larger buffers are allocated on their own
+
+            ~UniformAllocator() {
+                for (UniformResources& block : resources) {
+                    if (block.live && !block.bufferPool)
+                        delete[] block.uniformBuffer;
+                }
+            }
+
+            static size_t sizeClass(size_t size);
+            // A bufferSize of 0 gets no CPU buffer.
+            UniformResources* allocate(size_t shaderIdentifier, size_t bufferSize);
+            void free(UniformResources* block);
         };
     }
 
@@ -361,17 +591,22 @@ namespace TTRendering {
 	protected:
         // The context owns the resources, so handles can safely be copied around.
         UniformResources* _resources = nullptr;
+        uint32_t _generation = 0; // of _resources when the handle was created
         virtual bool isMaterialBlockHandle() const { return false; }
+        // False once the block was freed, even if it has been handed out again since.
+        bool isLive() const { return _resources && _resources->live && _resources->generation == _generation; }
 
 		bool _setUniform(const char* key, void* src, UniformType srcType, unsigned int count = 1);
 		UniformBlockHandle(const UniformInfo& uniformInfo, UniformResources* resources);
 		UniformBlockHandle(UniformResources* resources);
 
 	public:
-        const HandleDict<std::string, ImageHandle>& images() const { return _resources->images; }
+        const HandleDict<std::string, ImageHandle>& images() const { TT::assert(isLive()); return _resources->images; }
 
 		size_t size() const;
 		unsigned char* cpuBuffer() const;
+		// Call after writing to cpuBuffer() directly, so the whole block gets uploaded again.
+		void markDirty() const;
 
 		bool hasUniformBlock() const;
 
@@ -430,7 +665,7 @@ namespace TTRendering {
 
         static const UniformBlockHandle Null;
         operator bool() const { return *this != Null; }
-        bool operator==(const UniformBlockHandle& rhs) const { return _resources == rhs._resources && isMaterialBlockHandle() == rhs.isMaterialBlockHandle(); }
+        bool operator==(const UniformBlockHandle& rhs) const { return _resources == rhs._resources && _generation == rhs._generation && isMaterialBlockHandle() == rhs.isMaterialBlockHandle(); }
         bool operator!=(const UniformBlockHandle& rhs) const { return !operator==(rhs); }
 	};
 
@@ -465,7 +700,16 @@ namespace TTRendering {
         bool operator==(const MaterialHandle& rhs) const { return _shader.identifier() == rhs._shader.identifier() && UniformBlockHandle::operator==(rhs); }
         bool operator!=(const MaterialHandle& rhs) const { return !operator==(rhs); }
 	};
-    
+}
+
+// Before the draw queues, which key maps on materials.
+template<> struct std::hash<TTRendering::MaterialHandle> {
+    size_t operator()(const TTRendering::MaterialHandle& s) const noexcept {
+        return TT::hashCombine(TT::hashCombine(s._shader.identifier(), (size_t)s._resources), s._generation);
+    }
+};
+
+namespace TTRendering {
     // Group allocations for easy releasing
     struct ResourcePoolHandle : public HandleBase {
     protected:
@@ -489,6 +733,7 @@ namespace TTRendering {
         size_t materialQueueIndex = (size_t)-1;
         size_t meshLayoutQueueIndex = (size_t)-1;
         size_t meshIndex = (size_t)-1;
+        size_t serial = 0; // unique per draw for the lifetime of the pass, so stale entries can be told apart
 
 		bool isNull() {
 			// We dive into a tree to build this so we only need to check the last one.
@@ -496,59 +741,299 @@ namespace TTRendering {
 		}
     };
 
-    namespace {
-        struct DrawInfo {
-            size_t meshIdentifier = 0;
-            size_t instanceCount = 0;
-            const PushConstants* pushConstants = nullptr;
-        };
+    struct DrawInfo {
+        size_t meshIdentifier = 0;
+        size_t instanceCount = 0;
+        const PushConstants* pushConstants = nullptr;
+        size_t indirectBuffer = 0; // if set, the draw parameters are read from the command in this buffer
+    };
+
+    // Draws of one material, packed densely for iteration. Every draw has a slot that stays put while it lives,
+    // and the slot remembers the serial of its draw, so a stale RenderEntry can not remove another draw.
+    // Removing leaves a hole with a 0 mesh identifier, holes are squeezed out once they make up half of the draws.
+    // So draws always stay in insertion order, which blended materials rely on.
+    struct MeshQueue {
+        static const unsigned int noSlot = 0xFFFFFFFF;
 
-        struct MeshQueue {
-            size_t next = 0;
-            std::map<size_t, DrawInfo> orderedQueue = {};
-            auto begin() const { return orderedQueue.begin();}
-            auto end() const { return orderedQueue.end();}
+        struct Slot {
+            unsigned int dense; // index into draws while in use, next free slot otherwise
+            size_t serial; // 0 while free
         };
 
-        struct MaterialQueue {
-            std::unordered_map<size_t, size_t> materialIdentifierToQueueIndex;
+        std::vector<DrawInfo> draws;
+        std::vector<unsigned int> drawSlots; // parallel to draws
+        std::vector<Slot> slots;
+        unsigned int freeSlots = noSlot;
+        size_t numRemoved = 0; // holes in draws
+
+        size_t add(const DrawInfo& info, size_t serial);
+        void reserve(size_t count);
+        // Returns false if the slot does not hold the draw with this serial (anymore).
+        bool remove(size_t slot, size_t serial);
+        void compact();
+
+        // Includes removed draws, with a 0 mesh identifier.
+        auto begin() const { return draws.begin(); }
+        auto end() const { return draws.end(); }
+    };
+
+    struct MaterialQueue {
+        std::unordered_map<MaterialHandle, size_t> materialToQueueIndex;
+
+        std::vector<MaterialHandle> keys;
+        std::vector<MeshQueue> queues;
+
+        MeshQueue& fetch(const MaterialHandle& key, size_t& index);
+    };
+
+    struct ShaderQueue {
+        std::unordered_map<size_t, size_t> shaderIdentifierToQueueIndex;
+        std::vector<ShaderHandle> keys;
+        std::vector<MaterialQueue> queues;
+
+        MaterialQueue& fetch(const ShaderHandle& key, size_t& index);
+    };
+
+    struct DrawQueue {
+        std::unordered_map<size_t, size_t> meshLayoutHashToQueueIndex;
+        std::vector<size_t> keys;
+        std::vector<ShaderQueue> queues;
+
+        ShaderQueue& fetch(size_t key, size_t& index);
+    };
+
+    // Flat alternative to the DrawQueue tree.
+    // Every entry is a packed 64 bit sort key plus an index into payloads,
+    // so adding is an append and drawing is a linear scan over the keys after one radix sort.
+    // Layouts, shaders and materials are interned in first-seen order, so sorting
+    // yields the same grouping as the DrawQueue: layout > shader > material > insertion order.
+    struct DrawList {
+        static const unsigned int meshLayoutBits = 8;
+        static const unsigned int shaderBits = 12;
+        static const unsigned int materialBits = 16;
+        static const unsigned int depthBits = 28;
+        static_assert(meshLayoutBits + shaderBits + materialBits + depthBits == 64);
+
+        std::unordered_map<size_t, size_t> meshLayoutHashToIndex;
+        std::vector<size_t> meshLayouts;
+        std::unordered_map<size_t, size_t> shaderIdentifierToIndex;
+        std::vector<ShaderHandle> shaders;
+        std::unordered_map<MaterialHandle, size_t> materialToIndex;
+        std::vector<MaterialHandle> materials;
+
+        // Removed entries keep their payload slot (with a 0 mesh identifier) so RenderEntry indices stay valid.
+        // The slot is reused once sort dropped the key pointing at it, the serial tells the new draw apart.
+        std::vector<DrawInfo> payloads;
+        std::vector<size_t> payloadSerials; // to detect stale RenderEntry indices
+        std::vector<unsigned int> removedPayloads; // still referenced by a key
+        std::vector<unsigned int> freePayloads;
+        // Parallel arrays, sorted by key.
+        std::vector<unsigned long long> keys;
+        std::vector<unsigned int> payloadIndices;
+
+        size_t next = 0; // insertion order of the next draw, renumbered by sort
+        size_t numRemoved = 0;
+        bool sorted = true;
+
+        static size_t meshLayoutIndex(unsigned long long key) { return (size_t)(key >> (shaderBits + materialBits + depthBits)); }
+        static size_t shaderIndex(unsigned long long key) { return (size_t)(key >> (materialBits + depthBits)) & ((1ull << shaderBits) - 1); }
+        static size_t materialIndex(unsigned long long key) { return (size_t)(key >> depthBits) & ((1ull << materialBits) - 1); }
+
+        size_t add(size_t meshLayoutHash, const MaterialHandle& material, const DrawInfo& info, size_t serial);
+        // add split in two, so bulk adds can intern the states of a bucket once.
+        unsigned long long bucketKey(size_t meshLayoutHash, const MaterialHandle& material);
+        size_t append(unsigned long long bucketKey, const DrawInfo& info, size_t serial);
+        void reserve(size_t count);
+        bool remove(size_t payloadIndex, size_t serial);
+        void sort();
+        void clear();
+        // Forgets mesh layouts, shaders and materials no key refers to anymore.
+        void pruneStates();
+    };
+
+    // What draws are sorted by when a RenderPass sorts by depth.
+    struct DepthReference {
+        bool fromPosition = false;
+        float plane[4] = {}; // view depth of a point p is dot(plane.xyz, p) + plane.w
+        float position[3] = {}; // or the squared distance to this position if fromPosition
+
+        // Depth of the origin of the model matrix.
+        float depth(const PushConstants* pushConstants) const;
+    };
 
-            std::vector<MaterialHandle> keys;
-            std::vector<MeshQueue> queues;
+    // A draw with everything the context needs to issue it already looked up.
+    struct PassDraw {
+        size_t vertexArray;
+        unsigned int primitiveType; // backend specific
+        unsigned int indexType; // backend specific, 0 if not indexed
+        size_t numElements;
+        size_t baseVertex;
+        size_t firstIndex; // in indices
+        size_t instanceCount;
+        const PushConstants* pushConstants;
+        size_t indirectBuffer;
+    };
 
-            MeshQueue& fetch(const MaterialHandle& key, size_t& index);
+    // Flat list of what drawing a RenderPass takes. It is compiled from the draw queue when the pass
+    // was modified and replayed as is otherwise.
+    struct CommandList {
+        enum class Op : unsigned char {
+            UseShader, // argument indexes shaders
+            BindMaterial, // argument indexes materials
+            Draw, // argument indexes draws
+            MultiDraw, // draws [argument, argument + count) in one call
+            InstancedDraw, // draws [argument, argument + count) of the same mesh as instances of one draw
+            SortedDraws, // draws [argument, argument + count) one by one, in the order of sortedDraws
         };
 
-        struct ShaderQueue {
-            std::unordered_map<size_t, size_t> shaderIdentifierToQueueIndex;
-            std::vector<ShaderHandle> keys;
-            std::vector<MaterialQueue> queues;
+        struct Command {
+            Op op;
+            unsigned int count;
+            size_t argument;
+        };
 
-            MaterialQueue& fetch(const ShaderHandle& key, size_t& index);
+        struct Shader {
+            size_t identifier;
+            const UniformInfo* materialUniformInfo;
         };
 
-        struct DrawQueue {
-            std::unordered_map<size_t, size_t> meshLayoutHashToQueueIndex;
-            std::vector<size_t> keys;
-            std::vector<ShaderQueue> queues;
+        std::vector<Command> commands;
+        std::vector<Shader> shaders;
+        std::vector<MaterialHandle> materials;
+        std::vector<PassDraw> draws;
+        size_t resourceGeneration = 0; // of the context when compiled
+        // Modes of the pass when compiled. Draws that are issued one by one still feed their push constants
+        // through the storage buffer of the mode, as that is where the shaders of such passes read them.
+        bool multiDraw = false;
+        bool instancing = false;
+
+        // Draws of meshes with bounds, and those bounds, so they can be culled without touching the mesh pool.
+        std::vector<size_t> boundedDraws;
+        std::vector<Bounds> bounds;
+        std::vector<unsigned char> visibility; // per draw, empty if nothing was culled
+
+        // Draws of blended materials in depth sorted passes, drawn after all commands.
+        struct BlendedDraw {
+            size_t shader;
+            size_t material;
+            size_t draw;
+        };
+        std::vector<BlendedDraw> blendedDraws;
+
+        // Order of the draws of SortedDraws commands, front to back, and of blendedDraws, back to front.
+        std::vector<float> depths;
+        std::vector<size_t> sortedDraws;
+        std::vector<size_t> blendedOrder;
+
+        size_t sortedDraw(size_t i) const { return sortedDraws.empty() ? i : sortedDraws[i]; }
+        const BlendedDraw& blendedDraw(size_t i) const { return blendedDraws[blendedOrder.empty() ? i : blendedOrder[i]]; }
+        void sortByDepth(const DepthReference& reference);
+
+        bool isVisible(size_t draw) const { return visibility.empty() || visibility[draw]; }
+        // Tests the bounds transformed by the model matrix of their push constants against the frustum, four at a time.
+        void cull(const TT::Mat44& viewProjection);
+
+        void clear() {
+            commands.clear();
+            shaders.clear();
+            materials.clear();
+            draws.clear();
+            boundedDraws.clear();
+            bounds.clear();
+            visibility.clear();
+            blendedDraws.clear();
+            depths.clear();
+            sortedDraws.clear();
+            blendedOrder.clear();
+        }
+    };
 
-            ShaderQueue& fetch(size_t key, size_t& index);
+    // One draw for the bulk RenderPass::addToDrawQueue, with the same meaning as the arguments of the single one.
+    struct DrawRequest {
+        const MeshHandle* mesh;
+        const MaterialHandle* material;
+        const PushConstants* pushConstants = nullptr;
+        size_t instanceCount = 0;
+    };
+
+    // Draws grouped by (mesh layout, material) as they come in, so a RenderPass looks up every group once and only
+    // appends the draws. Scenes tend to add runs of the same bucket, so the previous one is checked first.
+    struct DrawBuckets {
+        struct Bucket {
+            size_t meshLayoutHash;
+            MaterialHandle material;
+            size_t count;
         };
-    }
+        struct KeyHash {
+            size_t operator()(const std::pair<size_t, MaterialHandle>& key) const { return TT::hashCombine(key.first, std::hash<MaterialHandle>{}(key.second)); }
+        };
+
+        std::vector<Bucket> buckets;
+        std::vector<DrawInfo> draws;
+        std::vector<unsigned int> drawBuckets; // parallel to draws
+        std::unordered_map<std::pair<size_t, MaterialHandle>, size_t, KeyHash> keyToBucket; // (mesh layout, material)
+        size_t previousBucket = (size_t)-1;
+
+        void add(size_t meshLayoutHash, const MaterialHandle& material, const DrawInfo& info);
+        void reserve(size_t count);
+        void clear();
+    };
+
+    // Records draws for a RenderPass away from the rendering thread. Recorders share no state and never touch the
+    // context, so every worker thread can fill its own without locking. Draws are bucketed while recording,
+    // so RenderPass::submit only resolves the buckets and merges the draws.
+    class DrawRecorder {
+        friend class RenderPass;
+
+        DrawBuckets _draws;
+
+    public:
+        // Same as RenderPass::addToDrawQueue, but returns the index of the draw in this recorder.
+        // RenderPass::submit can return the RenderEntry for every index.
+        size_t addToDrawQueue(const MeshHandle& mesh, const MaterialHandle& material, const PushConstants* pushConstants = nullptr, size_t instanceCount = 0);
+        void reserve(size_t count) { _draws.reserve(count); }
+        size_t size() const { return _draws.draws.size(); }
+        void clear() { _draws.clear(); }
+    };
+
+    enum class DrawQueueMode {
+        Nested, // DrawQueue tree, sorted on insertion
+        Sorted, // DrawList of sort keys, sorted once before drawing
+    };
 
 	class RenderPass {
 		BEFRIEND_CONTEXTS;
 
-		bool modified = true;
+		mutable bool modified = true; // reset by the context when it compiles _commandList
 
+        DrawQueueMode _drawQueueMode = DrawQueueMode::Nested;
+        bool _multiDrawIndirect = false;
+        bool _autoInstancing = false;
+        bool _frustumCulling = false;
+        TT::Mat44 _cullingViewProjection = TT::MAT44_IDENTITY;
+        bool _depthSorting = false;
+        DepthReference _depthReference;
 		DrawQueue _drawQueue;
+        mutable DrawList _drawList; // mutable because drawPass sorts it lazily
+        mutable CommandList _commandList;
+
+        size_t _nextSerial = 1; // never reset, so entries from before emptyQueue stay stale
+        RenderEntry addDraw(size_t meshLayoutHash, const MaterialHandle& material, const DrawInfo& info);
+        // Resolves every bucket once, then appends the draws. entries receives one RenderEntry per draw if given.
+        void addBuckets(const DrawBuckets& draws, RenderEntry* entries);
 
         UniformBlockHandle passUniforms = UniformBlockHandle::Null; // empty means we have no global uniforms to forward to the pipeline
         FramebufferHandle _framebuffer = FramebufferHandle::Null; // empty means we draw to screen
+        std::string _gpuTimerName; // empty means the pass is not timed
 
 	public:
         const DrawQueue& drawQueue() const { return _drawQueue; }
+        const DrawList& drawList() const { return _drawList; }
+        DrawQueueMode drawQueueMode() const { return _drawQueueMode; }
+        bool multiDrawIndirect() const { return _multiDrawIndirect; }
+        bool autoInstancing() const { return _autoInstancing; }
         const FramebufferHandle* framebuffer() const { return _framebuffer == FramebufferHandle::Null ? nullptr : &_framebuffer; }
+        const std::string& gpuTimerName() const { return _gpuTimerName; }
 
 		void setPassUniforms(UniformBlockHandle handle);
 		void clearPassUniforms();
@@ -560,8 +1045,55 @@ namespace TTRendering {
 		float clearDepthValue = 1.0f;
 
         RenderEntry addToDrawQueue(const MeshHandle& mesh, const MaterialHandle& material, const PushConstants* pushConstants = nullptr, size_t instanceCount = 0);
-        void removeFromDrawQueue(const RenderEntry& entry);
+        // Adds many draws at once. Every distinct (mesh layout, material) is looked up once and its storage reserved
+        // before the draws are filled in. If entries is given, it must hold draws.size() elements and receives the
+        // RenderEntry of every draw.
+        void addToDrawQueue(std::span<const DrawRequest> draws, RenderEntry* entries = nullptr);
+        // Draws with the parameters of the indirect command at the start of the buffer, as written on the GPU,
+        // e.g. by culling.compute.glsl. Such draws are never culled on the CPU nor batched into multi draws.
+        RenderEntry addIndirectToDrawQueue(const MeshHandle& mesh, const MaterialHandle& material, const BufferHandle& indirectCommand, const PushConstants* pushConstants = nullptr);
+        // Returns false and leaves the queue alone if the entry was removed already or is from before emptyQueue.
+        bool removeFromDrawQueue(const RenderEntry& entry);
 		void emptyQueue();
+
+        // Merges draws recorded on other threads into the queue, in recorder order, and clears the recorders.
+        // Must be called from the thread that owns the pass. If entries is given, the RenderEntry of every
+        // recorded draw is appended to it in the same order.
+        void submit(std::vector<DrawRecorder>& recorders, std::vector<RenderEntry>* entries = nullptr);
+
+        // Switching modes empties the queue, as entries can not be moved between representations.
+        void setDrawQueueMode(DrawQueueMode mode);
+
+        // Collapse consecutive draws of meshes that share their buffers into a single multi draw indirect call.
+        // Shaders used in such a pass must read their push constants from the StorageBufferSemantics::DrawPushConstants
+        // array, indexed by gl_DrawID, see image_indirect.vert.glsl. Draws that can not be batched, like indirect ones,
+        // become multi draws of their own, so they find their push constants there as well.
+        void setMultiDrawIndirect(bool enabled);
+
+        // Turn consecutive draws of the same mesh with the same material into one instanced draw.
+        // Shaders used in such a pass must read their push constants from the StorageBufferSemantics::InstancePushConstants
+        // array, indexed by gl_BaseInstance + gl_InstanceID, see image_autoinstanced.vert.glsl. That holds for single
+        // draws too, only explicitly instanced and indirect draws keep using the regular push constants.
+        void setAutoInstancing(bool enabled);
+
+        // Skip draws of meshes with bounds that are outside the frustum of this view projection matrix.
+        // Checked every time the pass is drawn, so moving the camera or the meshes does not recompile the pass.
+        void setFrustumCulling(const TT::Mat44& viewProjection);
+        void clearFrustumCulling();
+
+        // Sort opaque draws front to back within each state bucket, and draw those of blended materials (Alpha,
+        // PremultipliedAlpha and Additive) after everything else, back to front. Draws are sorted by the origin of
+        // their model matrix every time the pass is drawn. Sorted buckets are not multi drawn nor instanced, but every
+        // draw becomes a multi draw or an instance of its own, so the shaders of such passes work unchanged.
+        void setViewMatrix(const TT::Mat44& view);
+        // Sorts by distance to the camera instead of depth along the view direction.
+        void setCameraPosition(const TT::Vec3& position);
+        void clearDepthSorting();
+
+        // Measure the GPU time of every drawPass of this pass, see RenderingContext::gpuTiming.
+        // Passes with the same name add to the same timing.
+        void setGpuTimer(const std::string& name);
+        void clearGpuTimer();
 	};
 
 	enum class UniformBlockSemantics {
@@ -570,9 +1102,16 @@ namespace TTRendering {
 		Material = 2,
 	};
 
+    // Shader storage buffer bindings that are reserved by the renderer.
+	enum class StorageBufferSemantics {
+		InstancePushConstants = 6,
+		DrawPushConstants = 7,
+	};
+
 	enum class BufferMode {
 		StaticDraw = 0,
 		DynamicDraw = 1,
+		Stream = 2, // rewritten every frame through mapForWrite, see there
 	};
 
     // Meshes from files may be associated with transform hierarchies.
@@ -589,6 +1128,33 @@ namespace TTRendering {
         std::vector<std::string> materialNames;
     };
 
+    // Counters gathered between beginFrame and endFrame, all zero when TT_RENDERING_STATS is not defined.
+    struct FrameStats {
+        size_t passes = 0;
+        size_t computeDispatches = 0;
+        size_t drawCalls = 0; // a multi draw counts as one call
+        size_t instancedDraws = 0; // draw calls that draw instances, a subset of drawCalls
+        size_t triangles = 0; // excludes indirect draws, their counts live on the GPU
+        size_t stateChanges = 0; // binds and state toggles that reached the driver
+        size_t uniformBytesUploaded = 0;
+        size_t storageBufferBinds = 0;
+    };
+
+    // GPU time in milliseconds of a named pass or dispatch, over the last windowSize samples.
+    struct GpuTiming {
+        static constexpr size_t windowSize = 64;
+
+        double lastMs = 0.0;
+        double averageMs = 0.0;
+        double maxMs = 0.0;
+        size_t sampleCount = 0; // total, not capped by windowSize
+
+        void addSample(double ms);
+
+    private:
+        double window[windowSize] = {};
+    };
+
 	class RenderingContext {
         unsigned int screenWidth = 32;
         unsigned int screenHeight = 32;
@@ -596,12 +1162,13 @@ namespace TTRendering {
 		HandleDict<std::string, ShaderStageHandle> shaderStagePool; // file path or source code to shader stage map
 		HandleDict<size_t, ShaderHandle> shaderPool; // hash of the shader stages used by the shader to shader map
 		std::unordered_map<size_t, std::unordered_map<int, UniformInfo>> shaderUniformInfo; // shader identifier to uniform info map
+		std::unordered_map<size_t, SamplerInfo> shaderSamplerInfo; // shader identifier to sampler texture units map
 
         // CPU, 1 created per requested uniform block / material
-        std::vector<UniformResources*> materialResources;
+        UniformAllocator uniformAllocator;
 
         typedef std::variant<BufferHandle, MeshHandle, ImageHandle, FramebufferHandle, ShaderStageHandle, ShaderHandle, UniformBlockHandle, MaterialHandle, ResourcePoolHandle> ResourceHandle;
-        static const size_t defaultResourcePool = 1;
+        static constexpr size_t defaultResourcePool = 1;
         size_t nextResourcePoolId = defaultResourcePool + 1;
 
         RenderingContext(const RenderingContext&) = delete;
@@ -614,18 +1181,69 @@ namespace TTRendering {
 
         std::unordered_map<size_t, std::vector<ResourceHandle>> resourcePools; // pools to clean up in the destructor
         HandlePool<MeshHandle> meshes; // allocated meshes, used during drawPass
+        size_t resourceGeneration = 0; // bumped when meshes or shaders are deleted, as compiled passes may refer to them
+
+        // Static meshes of createArenaMesh share large buffers, and a vertex array per layout within each of them.
+        struct MeshArenaPage {
+            BufferHandle buffer; // Null once the page was released by compactMeshArena
+            RangeAllocator ranges;
+            std::unordered_map<size_t, MeshHandle> vertexArrays; // by mesh layout hash
+            bool open = true; // pages that are being compacted take no new meshes
+        };
+        struct MeshArenaRange {
+            size_t page;
+            size_t vertexOffset, vertexSize, vertexStride; // in bytes
+            size_t indexOffset, indexSize, indexStride; // in bytes, indexSize is 0 without indices
+        };
+        static constexpr size_t meshArenaPageSize = 64 * 1024 * 1024;
+        std::vector<MeshArenaPage> meshArenaPages;
+        std::unordered_map<size_t, MeshArenaRange> meshArenaRanges; // by mesh identifier
+        std::unordered_map<size_t, std::vector<MeshAttribute>> meshArenaLayouts; // by mesh layout hash
+        size_t nextArenaMeshIdentifier = (size_t)1 << 32; // above the range of backend names, arena meshes have no object of their own
+
+        // Finds room for a mesh in an open page, adding a page if none has.
+        MeshArenaRange allocateMeshArenaRange(size_t vertexSize, size_t vertexStride, size_t indexSize, size_t indexStride);
+        const MeshHandle& meshArenaVertexArray(size_t page, size_t meshLayoutHash);
+        // Returns whether the mesh lived in the arena, its vertex array must not be deleted then.
+        bool releaseArenaMesh(const MeshHandle& mesh);
+
+        mutable FrameStats stats; // counters of the frame in flight
+        FrameStats lastFrameStats; // counters of the last completed frame
+        void resetFrameStats() { stats = {}; }
+        void finishFrameStats() { lastFrameStats = stats; stats = {}; }
+
+        std::unordered_map<std::string, GpuTiming> timings;
+
+        // Image sizes are recorded whenever a backend creates or resizes an image, so they never have to be read back.
+        struct ImageExtent {
+            unsigned int width;
+            unsigned int height;
+            unsigned int mipLevels = 1;
+            unsigned int layers = 1;
+        };
+        std::unordered_map<size_t, ImageExtent> imageExtents; // by image identifier
+        const ImageExtent& imageExtent(const ImageHandle& image) const;
+        static bool hasMipChain(ImageInterpolation interpolation) { return interpolation == ImageInterpolation::Trilinear || interpolation == ImageInterpolation::Anisotropic; }
+        static unsigned int mipLevelCount(unsigned int width, unsigned int height);
 
         template<typename T> const T& registerHandleToPool(const T& handle, const ResourcePoolHandle* pool = nullptr) { resourcePools[pool ? pool->identifier() : defaultResourcePool].push_back(handle); return handle; }
 
         const MeshHandle& registerMesh(const MeshHandle& handle, const ResourcePoolHandle* pool = nullptr);
+        // setMeshBounds without invalidating compiled passes, for meshes no pass can refer to yet.
+        void storeMeshBounds(MeshHandle& mesh, const Bounds& bounds);
         const ShaderStageHandle& registerShaderStage(const char* glslFilePath, const ShaderStageHandle& handle, const ResourcePoolHandle* pool = nullptr);
-        const ShaderHandle& registerShader(size_t hash, const ShaderHandle& handle, const std::unordered_map<int, UniformInfo>& uniformBlocks, const ResourcePoolHandle* pool = nullptr);
+        const ShaderHandle& registerShader(size_t hash, const ShaderHandle& handle, const std::unordered_map<int, UniformInfo>& uniformBlocks, const SamplerInfo& samplers, const ResourcePoolHandle* pool = nullptr);
 
         void deregisterMesh(const MeshHandle& handle);
         void deregisterShaderStage(const ShaderStageHandle& handle);
         void deregisterShader(const ShaderHandle& handle);
 
+		// Releases the GPU copy of the material uniform block, if any.
+		virtual void deleteMaterialStorage(const MaterialHandle& material) = 0;
+
 		virtual std::unordered_map<int, UniformInfo> getUniformBlocks(const ShaderHandle& shader, const std::vector<ShaderStageHandle>& stages) const = 0;
+		// Reflects the sampler uniforms and permanently assigns them a texture unit each.
+		virtual SamplerInfo getSamplers(const ShaderHandle& shader) const = 0;
 
 		virtual ShaderStageHandle createShaderStage(const char* glslFilePath) = 0;
 		virtual ShaderHandle createShader(const std::vector<ShaderStageHandle>& stages) = 0;
@@ -640,6 +1258,7 @@ namespace TTRendering {
         }
 
         const UniformInfo* materialUniformInfo(const ShaderHandle& handle) const;
+        const SamplerInfo* samplerInfo(const ShaderHandle& handle) const;
 
         void deleteResourcePoolInternal(const ResourcePoolHandle& handle, bool erase = true);
 
@@ -649,9 +1268,25 @@ namespace TTRendering {
 
 		virtual void beginFrame() = 0;
 		virtual void endFrame() = 0;
+        // Snapshot of the counters of the last frame that went through endFrame. All zero without TT_RENDERING_STATS.
+        FrameStats frameStats() const { return lastFrameStats; }
+        // GPU timings are read back without stalling, so they lag a few frames behind. Null until the first sample arrived.
+        const GpuTiming* gpuTiming(const std::string& name) const;
+        const std::unordered_map<std::string, GpuTiming>& gpuTimings() const { return timings; }
 		virtual void drawPass(const RenderPass& pass, unsigned int defaultFramebuffer = 0) = 0;
 
 		virtual BufferHandle createBuffer(size_t size, unsigned char* data = nullptr, BufferMode mode = BufferMode::StaticDraw, const ResourcePoolHandle* pool = nullptr) = 0;
+        virtual void writeBuffer(const BufferHandle& buffer, const void* data, size_t size, size_t offset = 0) = 0;
+        // Pointer to the part of a BufferMode::Stream buffer the current frame draws from, valid for buffer.size() bytes.
+        // Every frame gets its own part, so the previous contents are not there and must be written in full.
+        // Meshes, SSBOs and indirect draws using the buffer follow it, the GPU sees the writes without flushing.
+        // May wait when the CPU runs more than two frames ahead of the GPU. Frames advance in endFrame.
+        virtual void* mapForWrite(const BufferHandle& buffer) = 0;
+        // The ranges must not overlap if both are in the same buffer.
+        virtual void copyBuffer(const BufferHandle& source, size_t sourceOffset, const BufferHandle& destination, size_t destinationOffset, size_t size) = 0;
+        // Writes an indirect command that draws all of the mesh with 0 instances, for a compute shader to count up.
+        // The buffer must hold at least 5 uints for indexed meshes and 4 otherwise.
+        void resetIndirectCommand(const BufferHandle& buffer, const MeshHandle& mesh);
 		virtual MeshHandle createMesh(
             size_t numElements, // num vertices if indexData == nullptr, else num indices
             BufferHandle vertexData, 
@@ -662,20 +1297,41 @@ namespace TTRendering {
             BufferHandle* instanceData = nullptr, // ignored if numInstances == 0
             const std::vector<MeshAttribute>& instanceAttributeLayout = {},
             const ResourcePoolHandle* pool = nullptr) = 0; // ignored if numInstances == 0 or instanceData == nullptr
+        // Uploads a static mesh into the shared mesh arena instead of buffers of its own. Meshes of the same layout in
+        // the same arena page share their buffers and vertex array, so they can be multi drawn together.
+        // The pool only controls the lifetime of the mesh, the arena owns the buffers.
+        MeshHandle createArenaMesh(
+            const void* vertexData, size_t vertexDataSize,
+            const std::vector<MeshAttribute>& attributeLayout,
+            const void* indexData = nullptr, size_t indexDataSize = 0, IndexType indexType = IndexType::None,
+            PrimitiveType primitiveType = PrimitiveType::Triangle,
+            const ResourcePoolHandle* pool = nullptr);
+        // Compaction hook. Moves the meshes of arena pages that are at most maxOccupancy full into other pages and
+        // releases the emptied pages. Handles held by the caller stay valid. Returns the number of released pages.
+        size_t compactMeshArena(float maxOccupancy = 0.25f);
+        // Sub-meshes are put in the mesh arena.
         MeshFileInfo loadMesh(const char* fbxFilePath, const ResourcePoolHandle* pool = nullptr);
+        // Meshes from loadMesh get their bounds from the position attribute, other meshes can be given bounds here.
+        void setMeshBounds(MeshHandle& mesh, const Bounds& bounds);
 		ShaderStageHandle fetchShaderStage(const char* glslFilePath, const ResourcePoolHandle* pool = nullptr);
 		ShaderHandle fetchShader(const std::vector<ShaderStageHandle>& stages, const ResourcePoolHandle* pool = nullptr);
 		UniformBlockHandle createUniformBuffer(const ShaderHandle& shader, const UniformBlockSemantics& semantic, const ResourcePoolHandle* pool = nullptr);
 		MaterialHandle createMaterial(const ShaderHandle& shader, MaterialBlendMode blendMode = MaterialBlendMode::Opaque, const ResourcePoolHandle* pool = nullptr);
 		virtual ImageHandle createImage(unsigned int width, unsigned int height, ImageFormat format, ImageInterpolation interpolation = ImageInterpolation::Linear, ImageTiling tiling = ImageTiling::Repeat, const unsigned char* data = nullptr, const ResourcePoolHandle* pool = nullptr) = 0;
-		ImageHandle loadImage(const char* filePath, ImageInterpolation interpolation = ImageInterpolation::Linear, ImageTiling tiling = ImageTiling::Repeat, const ResourcePoolHandle* pool = nullptr);
+		ImageHandle loadImage(const char* filePath, ImageInterpolation interpolation = ImageInterpolation::Linear, ImageTiling tiling = ImageTiling::Repeat, const ResourcePoolHandle* pool = nullptr, MipGeneration mips = MipGeneration::GPU);
+        // Replaces a whole mip level, data is tightly packed. Images with a mip chain get it generated on the GPU
+        // by createImage when given data, or can be created without data and have every level written here.
+        virtual void writeImageLevel(const ImageHandle& image, unsigned int level, const unsigned char* data) = 0;
         virtual FramebufferHandle createFramebuffer(const std::vector<ImageHandle>& colorAttachments, const ImageHandle* depthStencilAttachment = nullptr, const ResourcePoolHandle* pool = nullptr) = 0;
 
-        virtual void imageSize(const ImageHandle& image, unsigned int& width, unsigned int& height) const = 0;
-		virtual void framebufferSize(const FramebufferHandle& framebuffer, unsigned int& width, unsigned int& height) const = 0;
+        void imageSize(const ImageHandle& image, unsigned int& width, unsigned int& height) const;
+        unsigned int imageMipLevels(const ImageHandle& image) const { return imageExtent(image).mipLevels; }
+        unsigned int imageLayers(const ImageHandle& image) const { return imageExtent(image).layers; }
+		void framebufferSize(const FramebufferHandle& framebuffer, unsigned int& width, unsigned int& height) const;
 		virtual void resizeImage(const ImageHandle& image, unsigned int width, unsigned int height) = 0;
         virtual void resizeFramebuffer(const FramebufferHandle& framebuffer, unsigned int width, unsigned int height) = 0;
-        virtual void dispatchCompute(const MaterialHandle& material, unsigned int x, unsigned int y, unsigned int z) = 0;
+        // The dispatch is timed on the GPU when a timer name is given, see gpuTiming.
+        virtual void dispatchCompute(const MaterialHandle& material, unsigned int x, unsigned int y, unsigned int z, const char* gpuTimerName = nullptr) = 0;
 
 		virtual void deleteBuffer(const BufferHandle& buffer) = 0;
 		virtual void deleteMesh(const MeshHandle& mesh) = 0;
@@ -692,10 +1348,4 @@ namespace TTRendering {
 	};
 }
 
-template<> struct std::hash<TTRendering::MaterialHandle> {
-    size_t operator()(const TTRendering::MaterialHandle& s) const noexcept {
-        return TT::hashCombine(s._shader.identifier(), (size_t)s._resources);
-    }
-};
-
 #undef BEFRIEND_CONTEXTS